@@ -3,6 +3,13 @@
  *  Supports generation of random R x C matrices
  *  And operations on them
  *
+ *  Matrices are typed (int32, int64, float or double).  The per-type
+ *  multiply, sum and generate kernels are stamped out by MATRIX_KERNELS
+ *  below and picked at run time from the matrix's ElemType.  Sparse
+ *  (CSR) matrices live in sparse.c; the routines here hand them off by
+ *  MatFormat.  Large dense products take the recursive path, see
+ *  RECURSIVE MULTIPLY.
+ *
  *  University of Washington, Tacoma
  *  TCSS 422 - Operating Systems
  *  Spring 2019
@@ -17,64 +24,459 @@
 #include <string.h>
 #include <time.h>
 #include "matrix.h"
+#include "sparse.h"
 #include "pcmatrix.h"
 
+// Alignment of the element block, one cache line
+#define MATRIX_ALIGN 64
+
+// Independent partial sums in the reduction kernels.  Splitting the sum
+// lets the compiler keep a full vector of accumulators busy; a single
+// float accumulator can not be vectorized without -ffast-math.
+#define SUM_LANES 8
+
+static const char * elem_names[ELEM_TYPE_COUNT] = {
+  "int32", "int64", "float", "double"
+};
+
+size_t ElemSize(ElemType type)
+{
+  switch (type)
+  {
+    case ELEM_INT32:  return sizeof(int32_t);
+    case ELEM_INT64:  return sizeof(int64_t);
+    case ELEM_FLOAT:  return sizeof(float);
+    case ELEM_DOUBLE: return sizeof(double);
+    default:          assert(0);
+  }
+  return 0;
+}
+
+const char * ElemTypeName(ElemType type)
+{
+  if (type < 0 || type >= ELEM_TYPE_COUNT)
+    return "unknown";
+  return elem_names[type];
+}
+
+// Returns the ElemType called name, or -1
+int ParseElemType(const char * name)
+{
+  int i;
+  for (i = 0; i < ELEM_TYPE_COUNT; i++)
+    if (strcmp(name, elem_names[i]) == 0)
+      return i;
+  return -1;
+}
+
+// TYPED KERNELS
+// MATRIX_KERNELS(NAME, T, U, ACC) defines for element type T:
+//   gen_NAME      - fill with 1..10
+//   multiply_NAME - c = a * b in i-k-j order.  The inner loop runs down
+//                   contiguous rows of b and c so it vectorizes, and each
+//                   c[i][j] still adds its k terms in order, so results
+//                   match the i-j-k dot product exactly, floats included.
+//                   Arithmetic is done in U, the unsigned type of the same
+//                   width for the integer types, so overflow wraps the
+//                   same defined way it does on the Strassen path.
+//   sum_NAME      - sum of all elements, accumulated in ACC
+#define MATRIX_KERNELS(NAME, T, U, ACC)                                 \
+static void gen_##NAME(Matrix * mat)                                    \
+{                                                                       \
+  T * a = (T *) mat->rowp[0];                                           \
+  long n = (long) mat->rows * mat->cols;                                \
+  long i;                                                               \
+  for (i = 0; i < n; i++)                                               \
+    a[i] = (T) (1 + rand() % 10);                                       \
+}                                                                       \
+                                                                        \
+static void multiply_##NAME(Matrix * a, Matrix * b, Matrix * c)         \
+{                                                                       \
+  int n = b->cols;                                                      \
+  int i, j, k;                                                          \
+  assert(a->type == ELEM_TYPE_OF((T) 0));                               \
+  for (i = 0; i < a->rows; i++)                                         \
+  {                                                                     \
+    const U * ar = (const U *) a->rowp[i];                              \
+    U * restrict cr = (U *) c->rowp[i];                                 \
+    for (j = 0; j < n; j++)                                             \
+      cr[j] = 0;                                                        \
+    for (k = 0; k < a->cols; k++)                                       \
+    {                                                                   \
+      const U aik = ar[k];                                              \
+      const U * restrict br = (const U *) b->rowp[k];                   \
+      for (j = 0; j < n; j++)                                           \
+        cr[j] += aik * br[j];                                           \
+    }                                                                   \
+  }                                                                     \
+}                                                                       \
+                                                                        \
+static ACC sum_##NAME(Matrix * mat)                                     \
+{                                                                       \
+  const T * restrict a = (const T *) mat->rowp[0];                      \
+  long n = (long) mat->rows * mat->cols;                                \
+  ACC part[SUM_LANES] = {0};                                            \
+  ACC total = 0;                                                        \
+  long i;                                                               \
+  int l;                                                                \
+  for (i = 0; i + SUM_LANES <= n; i += SUM_LANES)                       \
+    for (l = 0; l < SUM_LANES; l++)                                     \
+      part[l] += a[i + l];                                              \
+  for (; i < n; i++)                                                    \
+    total += a[i];                                                      \
+  for (l = 0; l < SUM_LANES; l++)                                       \
+    total += part[l];                                                   \
+  return total;                                                         \
+}
+
+MATRIX_KERNELS(int32, int32_t, uint32_t, int64_t)
+MATRIX_KERNELS(int64, int64_t, uint64_t, int64_t)
+MATRIX_KERNELS(float, float, float, double)
+MATRIX_KERNELS(double, double, double, double)
+
+// RECURSIVE MULTIPLY
+// Dense products with every dimension above MULTIPLY_CUTOFF recurse:
+//   int32/int64  - Strassen-Winograd, 7 half-size products per level
+//                  instead of 8.  The arithmetic runs in the unsigned type
+//                  of the same width, so intermediate sums wrap instead of
+//                  overflowing and the result equals the i-j-k loop bit
+//                  for bit.  Odd dimensions are peeled off and finished
+//                  with the plain loops.
+//   float/double - halve the largest dimension until the blocks fit under
+//                  the cutoff.  Halves of k are accumulated in order into
+//                  the same c, so every c[i][j] still adds its k terms in
+//                  the reference order and rounds the same way.
+// Strassen temporaries come from a per-thread workspace that is sized once
+// per multiply and kept for the next one, never a malloc per level.
+
+typedef struct workspace {
+  char * base;
+  size_t size;
+  size_t top;
+} Workspace;
+
+static __thread Workspace ws = { NULL, 0, 0 };
+
+static size_t ws_round(size_t bytes)
+{
+  return (bytes + MATRIX_ALIGN - 1) & ~(size_t) (MATRIX_ALIGN - 1);
+}
+
+static void ws_reserve(size_t bytes)
+{
+  assert(ws.top == 0);
+  if (bytes <= ws.size)
+    return;
+  free(ws.base);
+  if (posix_memalign((void **) &ws.base, MATRIX_ALIGN, bytes) != 0)
+    ws.base = NULL;
+  assert(ws.base != 0);
+  ws.size = bytes;
+}
+
+// Stack allocation from the workspace; callers pop by restoring ws.top
+static void * ws_push(size_t bytes)
+{
+  void * p = ws.base + ws.top;
+  ws.top += ws_round(bytes);
+  assert(ws.top <= ws.size);
+  return p;
+}
+
+void FreeMatrixWorkspace()
+{
+  free(ws.base);
+  ws.base = NULL;
+  ws.size = 0;
+  ws.top = 0;
+}
+
+static int recurse_at(int m, int k, int n)
+{
+  return MULTIPLY_CUTOFF > 0 && m > MULTIPLY_CUTOFF &&
+         k > MULTIPLY_CUTOFF && n > MULTIPLY_CUTOFF;
+}
+
+// Workspace bytes for a Strassen-Winograd m x k by k x n multiply
+static size_t strassen_need(int m, int k, int n, size_t esize)
+{
+  if (!recurse_at(m, k, n))
+    return 0;
+  int m2 = m / 2, k2 = k / 2, n2 = n / 2;
+  return ws_round((size_t) m2 * k2 * esize) + ws_round((size_t) k2 * n2 * esize) +
+         ws_round((size_t) m2 * n2 * esize) + strassen_need(m2, k2, n2, esize);
+}
+
+// RECURSIVE_KERNELS(NAME, T) defines gemm_acc_NAME, c += a * b on
+// strided blocks, splitting the largest dimension above the cutoff
+#define RECURSIVE_KERNELS(NAME, T)                                      \
+static void gemm_acc_##NAME(int m, int k, int n, const T * a, int lda,  \
+                            const T * b, int ldb, T * c, int ldc)       \
+{                                                                       \
+  int i, j, p, h;                                                       \
+  if (m > MULTIPLY_CUTOFF && m >= k && m >= n)                          \
+  {                                                                     \
+    h = m / 2;                                                          \
+    gemm_acc_##NAME(h, k, n, a, lda, b, ldb, c, ldc);                   \
+    gemm_acc_##NAME(m - h, k, n, a + (long) h * lda, lda, b, ldb,       \
+                    c + (long) h * ldc, ldc);                           \
+    return;                                                             \
+  }                                                                     \
+  if (n > MULTIPLY_CUTOFF && n >= k)                                    \
+  {                                                                     \
+    h = n / 2;                                                          \
+    gemm_acc_##NAME(m, k, h, a, lda, b, ldb, c, ldc);                   \
+    gemm_acc_##NAME(m, k, n - h, a, lda, b + h, ldb, c + h, ldc);       \
+    return;                                                             \
+  }                                                                     \
+  if (k > MULTIPLY_CUTOFF)                                              \
+  {                                                                     \
+    /* lower half of k first, so terms arrive in order */               \
+    h = k / 2;                                                          \
+    gemm_acc_##NAME(m, h, n, a, lda, b, ldb, c, ldc);                   \
+    gemm_acc_##NAME(m, k - h, n, a + h, lda, b + (long) h * ldb, ldb,   \
+                    c, ldc);                                            \
+    return;                                                             \
+  }                                                                     \
+  for (i = 0; i < m; i++)                                               \
+  {                                                                     \
+    T * restrict cr = c + (long) i * ldc;                               \
+    for (p = 0; p < k; p++)                                             \
+    {                                                                   \
+      const T aip = a[(long) i * lda + p];                              \
+      const T * restrict br = b + (long) p * ldb;                       \
+      for (j = 0; j < n; j++)                                           \
+        cr[j] += aip * br[j];                                           \
+    }                                                                   \
+  }                                                                     \
+}
+
+// STRASSEN_KERNELS(NAME, U) defines strassen_NAME, c = a * b on strided
+// blocks of the unsigned element type U
+#define STRASSEN_KERNELS(NAME, U)                                       \
+static void base_##NAME(int m, int k, int n, const U * a, int lda,      \
+                        const U * b, int ldb, U * c, int ldc)           \
+{                                                                       \
+  int i, j, p;                                                          \
+  for (i = 0; i < m; i++)                                               \
+  {                                                                     \
+    U * restrict cr = c + (long) i * ldc;                               \
+    for (j = 0; j < n; j++)                                             \
+      cr[j] = 0;                                                        \
+    for (p = 0; p < k; p++)                                             \
+    {                                                                   \
+      const U aip = a[(long) i * lda + p];                              \
+      const U * restrict br = b + (long) p * ldb;                       \
+      for (j = 0; j < n; j++)                                           \
+        cr[j] += aip * br[j];                                           \
+    }                                                                   \
+  }                                                                     \
+}                                                                       \
+                                                                        \
+static void add_##NAME(int m, int n, const U * x, int ldx,              \
+                       const U * y, int ldy, U * z, int ldz)            \
+{                                                                       \
+  int i, j;                                                             \
+  for (i = 0; i < m; i++)                                               \
+    for (j = 0; j < n; j++)                                             \
+      z[(long) i * ldz + j] = x[(long) i * ldx + j] + y[(long) i * ldy + j]; \
+}                                                                       \
+                                                                        \
+static void sub_##NAME(int m, int n, const U * x, int ldx,              \
+                       const U * y, int ldy, U * z, int ldz)            \
+{                                                                       \
+  int i, j;                                                             \
+  for (i = 0; i < m; i++)                                               \
+    for (j = 0; j < n; j++)                                             \
+      z[(long) i * ldz + j] = x[(long) i * ldx + j] - y[(long) i * ldy + j]; \
+}                                                                       \
+                                                                        \
+static void strassen_##NAME(int m, int k, int n, const U * a, int lda,  \
+                            const U * b, int ldb, U * c, int ldc)       \
+{                                                                       \
+  int i, j, p;                                                          \
+  if (!recurse_at(m, k, n))                                             \
+  {                                                                     \
+    base_##NAME(m, k, n, a, lda, b, ldb, c, ldc);                       \
+    return;                                                             \
+  }                                                                     \
+  int m2 = m / 2, k2 = k / 2, n2 = n / 2;                               \
+  const U * a11 = a, * a12 = a + k2;                                    \
+  const U * a21 = a + (long) m2 * lda, * a22 = a21 + k2;                \
+  const U * b11 = b, * b12 = b + n2;                                    \
+  const U * b21 = b + (long) k2 * ldb, * b22 = b21 + n2;                \
+  U * c11 = c, * c12 = c + n2;                                          \
+  U * c21 = c + (long) m2 * ldc, * c22 = c21 + n2;                      \
+  size_t top = ws.top;                                                  \
+  U * x = (U *) ws_push((size_t) m2 * k2 * sizeof(U));                  \
+  U * y = (U *) ws_push((size_t) k2 * n2 * sizeof(U));                  \
+  U * z = (U *) ws_push((size_t) m2 * n2 * sizeof(U));                  \
+  /* P7 = (A11 - A21)(B22 - B12) */                                     \
+  sub_##NAME(m2, k2, a11, lda, a21, lda, x, k2);                        \
+  sub_##NAME(k2, n2, b22, ldb, b12, ldb, y, n2);                        \
+  strassen_##NAME(m2, k2, n2, x, k2, y, n2, c21, ldc);                  \
+  /* P5 = S1 T1 = (A21 + A22)(B12 - B11) */                             \
+  add_##NAME(m2, k2, a21, lda, a22, lda, x, k2);                        \
+  sub_##NAME(k2, n2, b12, ldb, b11, ldb, y, n2);                        \
+  strassen_##NAME(m2, k2, n2, x, k2, y, n2, c22, ldc);                  \
+  /* P6 = S2 T2 = (S1 - A11)(B22 - T1) */                               \
+  sub_##NAME(m2, k2, x, k2, a11, lda, x, k2);                           \
+  sub_##NAME(k2, n2, b22, ldb, y, n2, y, n2);                           \
+  strassen_##NAME(m2, k2, n2, x, k2, y, n2, c12, ldc);                  \
+  /* S4 = A12 - S2, P1 = A11 B11 */                                     \
+  sub_##NAME(m2, k2, a12, lda, x, k2, x, k2);                           \
+  strassen_##NAME(m2, k2, n2, a11, lda, b11, ldb, z, n2);               \
+  /* U2 = P1 + P6, U3 = U2 + P7, U4 = U2 + P5, C22 = U3 + P5 */         \
+  add_##NAME(m2, n2, c12, ldc, z, n2, c12, ldc);                        \
+  add_##NAME(m2, n2, c21, ldc, c12, ldc, c21, ldc);                     \
+  add_##NAME(m2, n2, c12, ldc, c22, ldc, c12, ldc);                     \
+  add_##NAME(m2, n2, c22, ldc, c21, ldc, c22, ldc);                     \
+  /* C11 = P1 + P2 = P1 + A12 B21 */                                    \
+  strassen_##NAME(m2, k2, n2, a12, lda, b21, ldb, c11, ldc);            \
+  add_##NAME(m2, n2, c11, ldc, z, n2, c11, ldc);                        \
+  /* C12 = U4 + P3 = U4 + S4 B22 */                                     \
+  strassen_##NAME(m2, k2, n2, x, k2, b22, ldb, z, n2);                  \
+  add_##NAME(m2, n2, c12, ldc, z, n2, c12, ldc);                        \
+  /* C21 = U3 - P4 = U3 - A22 (T2 - B21) */                             \
+  sub_##NAME(k2, n2, y, n2, b21, ldb, y, n2);                           \
+  strassen_##NAME(m2, k2, n2, a22, lda, y, n2, z, n2);                  \
+  sub_##NAME(m2, n2, c21, ldc, z, n2, c21, ldc);                        \
+  ws.top = top;                                                         \
+  /* Peel odd dimensions: last k adds a rank one update, last column */ \
+  /* and last row are computed directly */                              \
+  if (k & 1)                                                            \
+  {                                                                     \
+    const U * bk = b + (long) (k - 1) * ldb;                            \
+    for (i = 0; i < 2 * m2; i++)                                        \
+    {                                                                   \
+      const U aik = a[(long) i * lda + k - 1];                          \
+      U * restrict cr = c + (long) i * ldc;                             \
+      for (j = 0; j < 2 * n2; j++)                                      \
+        cr[j] += aik * bk[j];                                           \
+    }                                                                   \
+  }                                                                     \
+  if (n & 1)                                                            \
+  {                                                                     \
+    for (i = 0; i < 2 * m2; i++)                                        \
+    {                                                                   \
+      U sum = 0;                                                        \
+      for (p = 0; p < k; p++)                                           \
+        sum += a[(long) i * lda + p] * b[(long) p * ldb + n - 1];       \
+      c[(long) i * ldc + n - 1] = sum;                                  \
+    }                                                                   \
+  }                                                                     \
+  if (m & 1)                                                            \
+    base_##NAME(1, k, n, a + (long) (m - 1) * lda, lda, b, ldb,         \
+                c + (long) (m - 1) * ldc, ldc);                         \
+}
+
+RECURSIVE_KERNELS(float, float)
+RECURSIVE_KERNELS(double, double)
+STRASSEN_KERNELS(int32, uint32_t)
+STRASSEN_KERNELS(int64, uint64_t)
+
+// c = a * b through the recursive path for c's element type
+static void multiply_recursive(Matrix * a, Matrix * b, Matrix * c)
+{
+  int m = a->rows, k = a->cols, n = b->cols;
+  size_t esize = ElemSize(a->type);
+  switch (a->type)
+  {
+    case ELEM_INT32:
+      ws_reserve(strassen_need(m, k, n, esize));
+      strassen_int32(m, k, n, (uint32_t *) a->rowp[0], k, (uint32_t *) b->rowp[0], n,
+                     (uint32_t *) c->rowp[0], n);
+      break;
+    case ELEM_INT64:
+      ws_reserve(strassen_need(m, k, n, esize));
+      strassen_int64(m, k, n, (uint64_t *) a->rowp[0], k, (uint64_t *) b->rowp[0], n,
+                     (uint64_t *) c->rowp[0], n);
+      break;
+    case ELEM_FLOAT:
+      memset(c->rowp[0], 0, (size_t) m * n * esize);
+      gemm_acc_float(m, k, n, a->mf[0], k, b->mf[0], n, c->mf[0], n);
+      break;
+    case ELEM_DOUBLE:
+      memset(c->rowp[0], 0, (size_t) m * n * esize);
+      gemm_acc_double(m, k, n, a->md[0], k, b->md[0], n, c->md[0], n);
+      break;
+    default:
+      assert(0);
+  }
+}
 
 // MATRIX ROUTINES
 Matrix * AllocMatrix(int r, int c)
+{
+  return AllocMatrixOfType(r, c, ELEM_INT32);
+}
+
+Matrix * AllocMatrixOfType(int r, int c, ElemType type)
 {
   Matrix * mat;
   mat = (Matrix *) malloc(sizeof(Matrix));
-  int ** a;
+  assert(mat != 0);
+  size_t esize = ElemSize(type);
+  void ** a;
+  char * data;
   int i;
-  a = (int**) malloc(sizeof(int *) * r);
+  a = (void **) malloc(sizeof(void *) * r);
   assert(a != 0);
+  // One block for all rows keeps the kernels on contiguous memory
+  if (posix_memalign((void **) &data, MATRIX_ALIGN, (size_t) r * c * esize) != 0)
+    data = NULL;
+  assert(data != 0);
   for (i = 0; i < r; i++)
   {
-    a[i] = (int *) malloc(c * sizeof(int));
-    assert(a[i] != 0);
+    a[i] = data + (size_t) i * c * esize;
   }
-  mat->m=a;
+  mat->rowp=a;
   mat->rows=r;
   mat->cols=c;
+  mat->type=type;
+  mat->format=FMT_DENSE;
   return mat;
 }
 
 void FreeMatrix(Matrix * mat)
 {
-  int r = mat->rows;
-  //int c = mat->cols;
-  int **a = mat->m;
-  int i;
-  for (i=0; i<r; i++)
+  if (mat->format == FMT_CSR)
   {
-    free(a[i]);
+    FreeSparse(mat);
+    return;
   }
-  free(a);
+  free(mat->rowp[0]);
+  free(mat->rowp);
   free(mat);
 }
 
 void GenMatrix(Matrix * mat)
 {
-  int height = mat->rows;
-  int width = mat->cols;
-  int ** a = mat->m;
-  int i, j;
-  for (i = 0; i < height; i++)
+  switch (mat->type)
   {
-    for (j = 0; j < width; j++)
-    {
-      int * mm = a[i];
-      //matrix[i * width + j] = rand() % 10;
-      mm[j] = 1 + rand() % 10;
-      //mm[j] = 1;
-#if OUTPUT
-      printf("matrix[%d][%d]=%d \n",i,j,mm[j]);
-#endif
-    }
+    case ELEM_INT32:  gen_int32(mat);  break;
+    case ELEM_INT64:  gen_int64(mat);  break;
+    case ELEM_FLOAT:  gen_float(mat);  break;
+    case ELEM_DOUBLE: gen_double(mat); break;
+    default:          assert(0);
   }
 }
 
+// Lay out an r x c matrix in the storage mat already owns, which must
+// have room for r row pointers and r*c elements.  Rows stay contiguous.
+void ShapeMatrix(Matrix * mat, int r, int c)
+{
+  size_t esize = ElemSize(mat->type);
+  char * data = (char *) mat->rowp[0];
+  int i;
+  for (i = 0; i < r; i++)
+  {
+    mat->rowp[i] = data + (size_t) i * c * esize;
+  }
+  mat->rows=r;
+  mat->cols=c;
+}
+
 Matrix * GenMatrixRandom()
 {
   int row = 1 + rand() % 4;
@@ -85,112 +487,142 @@ Matrix * GenMatrixRandom()
 }
 
 Matrix * GenMatrixBySize(int row, int col)
+{
+  return GenMatrixOfType(row, col, ELEM_INT32);
+}
+
+Matrix * GenMatrixOfType(int row, int col, ElemType type)
 {
 //  printf("Generate random matrix (RxC) = (%dx%d)\n",row,col);
-  Matrix * mat = AllocMatrix(row, col);
+  Matrix * mat = AllocMatrixOfType(row, col, type);
   GenMatrix(mat);
   return mat;
 }
 
+// Bytes of element storage for a row x col matrix; this is what the
+// bounded buffer charges against BOUNDED_BUFFER_BYTES
+long MatrixBytes(int row, int col, ElemType type)
+{
+  return (long) row * col * ElemSize(type);
+}
+
+// Bytes actually held by a matrix of either format
+long MatrixFootprint(Matrix * mat)
+{
+  if (mat->format == FMT_CSR)
+    return SparseFootprint(mat);
+  return MatrixBytes(mat->rows, mat->cols, mat->type);
+}
+
 Matrix * MatrixMultiply(Matrix * m1, Matrix * m2)
 {
   if ((m1==NULL) || (m2==NULL))
+  {
     printf("m1=%p  m2=%p!\n",m1,m2);
-  return NULL;
-  int sum=0;
-  if (m1->cols != m2->rows)
+    return NULL;
+  }
+  if ((m1->cols != m2->rows) || (m1->type != m2->type))
   {
     return NULL;
   }
+#if OUTPUT
   printf("MULTIPLY (%d x %d) BY (%d x %d):\n",m1->rows,m1->cols,m2->rows,m2->cols);
-  Matrix * newmat = AllocMatrix(m1->rows, m2->cols);
-  int ** nm = newmat->m;
-  int ** ma1 = m1->m;
-  int ** ma2 = m2->m;
-  for (int c=0;c<newmat->rows;c++)
+#endif
+  // Pick the kernel by operand format
+  if (m1->format == FMT_CSR && m2->format == FMT_CSR)
+    return SparseMultiplySparse(m1, m2);
+  if (m1->format == FMT_CSR)
+    return SparseMultiplyDense(m1, m2);
+  if (m2->format == FMT_CSR)
+    return DenseMultiplySparse(m1, m2);
+  Matrix * newmat = AllocMatrixOfType(m1->rows, m2->cols, m1->type);
+  if (recurse_at(m1->rows, m1->cols, m2->cols))
   {
-    for (int d=0;d<newmat->cols;d++)
-    {
-      for (int k=0;k<m2->rows;k++)
-      {
-        sum = sum + ma1[c][k]*ma2[k][d];
-      }
-      nm[c][d] = sum;
-      sum=0;
-    }
+    multiply_recursive(m1, m2, newmat);
+    return newmat;
+  }
+  switch (m1->type)
+  {
+    case ELEM_INT32:  multiply_int32(m1, m2, newmat);  break;
+    case ELEM_INT64:  multiply_int64(m1, m2, newmat);  break;
+    case ELEM_FLOAT:  multiply_float(m1, m2, newmat);  break;
+    case ELEM_DOUBLE: multiply_double(m1, m2, newmat); break;
+    default:          assert(0);
   }
   return newmat;
 }
 
 void DisplayMatrix(Matrix * mat, FILE *stream)
 {
-  if ((mat == NULL) || (mat->m == NULL))
+  if ((mat != NULL) && (mat->format == FMT_CSR))
+  {
+    DisplaySparse(mat, stream);
+    return;
+  }
+  if ((mat == NULL) || (mat->rowp == NULL))
   {
     printf("DisplayMatrix: EMPTY matrix\n");
     return;
   }
-  int ** matrix = mat->m;
   int height = mat->rows;
   int width = mat->cols;
-  int y=0;
   int i, j;
   for (i=0; i<height; i++)
   {
-    int *mm = matrix[i];
     fprintf(stream, "|");
     for (j=0; j<width; j++)
     {
-      y=mm[j];
-      if (j==0)
-        fprintf(stream, "%3d",y);
-      else
-        fprintf(stream, " %3d",y);
+      if (j!=0)
+        fprintf(stream, " ");
+      switch (mat->type)
+      {
+        case ELEM_INT32:  fprintf(stream, "%3d", mat->m[i][j]); break;
+        case ELEM_INT64:  fprintf(stream, "%3lld", (long long) mat->m64[i][j]); break;
+        case ELEM_FLOAT:  fprintf(stream, "%6.2f", mat->mf[i][j]); break;
+        case ELEM_DOUBLE: fprintf(stream, "%6.2f", mat->md[i][j]); break;
+        default:          assert(0);
+      }
     }
     fprintf(stream, "|\n");
   }
 }
 
 
-int AvgElement(Matrix * mat) // int ** matrix, const int height, const int width)
+int AvgElement(Matrix * mat)
 {
-  int ** a = mat->m;
-  int height = mat->rows;
-  int width = mat->cols;
-  int x=0;
-  int y=0;
-  int ele=0;
-  int i, j;
-  for (i=0; i<height; i++)
-    for (j=0; j<width; j++)
-    {
-      int *mm = a[i];
-      y=mm[j];
-      x=x+y;
-      ele++;
-#if OUTPUT
-      printf("[%d][%d]--%d x=%d ele=%d\n",i,j,mm[j],x,ele);
-#endif
-    }
-  printf("x=%d ele=%d\n",x, ele);
+  long long x = SumMatrix(mat);
+  int ele = mat->rows * mat->cols;
+  printf("x=%lld ele=%d\n",x, ele);
   return x / ele;
 }
 
-int SumMatrix(Matrix * mat) {
-  int ** a = mat->m;
-  int height = mat->rows;
-  int width = mat->cols;
-  int i =0;
-  int j =0;
-  int y =0;
-  int total = 0;
-  for (i = 0; i < height; i++)
+// Sum of all elements.  Integer matrices are summed exactly in 64 bits;
+// float and double sums are rounded toward zero, use SumMatrixReal for
+// the fractional part.
+long long SumMatrix(Matrix * mat) {
+  if (mat->format == FMT_CSR)
+    return SumSparse(mat);
+  switch (mat->type)
   {
-    for (j = 0; j < width; j++)
-    {
-      int *mm = a[i];
-      y=mm[j];
-      total = total+y;
-    }
+    case ELEM_INT32:  return sum_int32(mat);
+    case ELEM_INT64:  return sum_int64(mat);
+    case ELEM_FLOAT:  return (long long) sum_float(mat);
+    case ELEM_DOUBLE: return (long long) sum_double(mat);
+    default:          assert(0);
+  }
+  return 0;
+}
+
+double SumMatrixReal(Matrix * mat) {
+  if (mat->format == FMT_CSR)
+    return SumSparseReal(mat);
+  switch (mat->type)
+  {
+    case ELEM_INT32:  return (double) sum_int32(mat);
+    case ELEM_INT64:  return (double) sum_int64(mat);
+    case ELEM_FLOAT:  return sum_float(mat);
+    case ELEM_DOUBLE: return sum_double(mat);
+    default:          assert(0);
   }
-  return total;
+  return 0;
 }
@@ -7,24 +7,90 @@
  *  Spring 2019
  */
 
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <stdio.h>
+#include <stdint.h>
+
 #define ROW 5
 #define COL 5
 
+// MATRIX ELEMENT TYPES
+// Every matrix carries its element type so the buffer, the kernels and
+// the stats can tell an int32 matrix from a double one at run time.
+typedef enum elem_type {
+  ELEM_INT32,
+  ELEM_INT64,
+  ELEM_FLOAT,
+  ELEM_DOUBLE,
+  ELEM_TYPE_COUNT
+} ElemType;
+
+// Element type of a C expression, for the macro generated kernels
+#define ELEM_TYPE_OF(x) _Generic((x), \
+  int32_t: ELEM_INT32,                \
+  int64_t: ELEM_INT64,                \
+  float:   ELEM_FLOAT,                \
+  double:  ELEM_DOUBLE)
+
+// MATRIX STORAGE FORMATS
+// FMT_DENSE - rows point into one contiguous block of rows*cols elements
+// FMT_CSR   - compressed sparse rows, only the nonzeros are stored
+typedef enum mat_format {
+  FMT_DENSE,
+  FMT_CSR
+} MatFormat;
+
+// Row i of a CSR matrix holds the nonzeros rowptr[i] .. rowptr[i+1]-1,
+// with their column numbers, ascending, in colidx and values in vals
+typedef struct csr {
+  long nnz;
+  long cap;
+  int * rowptr;
+  int * colidx;
+  void * vals;
+} CSR;
+
+// The union gives typed access to the dense row pointers; m is the int32
+// view existing code uses.  For FMT_CSR the row pointers are NULL and the
+// data lives in csr.
 typedef struct matrix {
   int rows;
   int cols;
-  int ** m;
+  ElemType type;
+  MatFormat format;
+  union {
+    int ** m;
+    int64_t ** m64;
+    float ** mf;
+    double ** md;
+    void ** rowp;
+  };
+  CSR csr;
 } Matrix;
 
 int theseed;
 
 // MATRIX ROUTINES
 Matrix * AllocMatrix(int r, int c);
+Matrix * AllocMatrixOfType(int r, int c, ElemType type);
 void FreeMatrix(Matrix * mat);
 void GenMatrix(Matrix * mat);
+void ShapeMatrix(Matrix * mat, int r, int c);
 Matrix * GenMatrixRandom();
 int AvgElement(Matrix * mat);
-int SumMatrix(Matrix * mat);
+long long SumMatrix(Matrix * mat);
+double SumMatrixReal(Matrix * mat);
 Matrix * MatrixMultiply(Matrix * m1, Matrix * m2);
+void FreeMatrixWorkspace();
 void DisplayMatrix(Matrix * mat, FILE *stream);
 Matrix * GenMatrixBySize(int row, int col);
+Matrix * GenMatrixOfType(int row, int col, ElemType type);
+long MatrixBytes(int row, int col, ElemType type);
+long MatrixFootprint(Matrix * mat);
+size_t ElemSize(ElemType type);
+const char * ElemTypeName(ElemType type);
+int ParseElemType(const char * name);
+
+#endif
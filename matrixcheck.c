@@ -0,0 +1,109 @@
+/*
+ *  matrixcheck module
+ *  Exactness check for the recursive multiply paths
+ *
+ *  Multiplies random matrices of every element type with MULTIPLY_CUTOFF
+ *  at 0 (the plain loops) and again at a range of nonzero cutoffs, and
+ *  requires the products to match byte for byte.  Shapes include odd
+ *  sizes so Strassen-Winograd has to peel, and float/double elements are
+ *  fractional so any change to the order the k halves are summed in
+ *  shows up as a rounding difference.
+ *
+ *  usage: matrix_check [shapes per type] [seed]
+ *
+ *  University of Washington, Tacoma
+ *  TCSS 422 - Operating Systems
+ *  Spring 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "matrix.h"
+#include "pcmatrix.h"
+
+// Largest side of a random shape
+#define CHECK_MAX_DIM 160
+
+// Cutoffs compared against the plain loops
+static const int cutoffs[] = { 1, 2, 3, 8, 17, 64, 128 };
+
+// Fill with values that exercise wraparound for the integer types and
+// rounding for the floating point ones
+static void fill_random(Matrix * mat)
+{
+  long n = (long) mat->rows * mat->cols;
+  long i;
+  for (i = 0; i < n; i++)
+  {
+    int r = rand();
+    switch (mat->type)
+    {
+      case ELEM_INT32:  ((int32_t *) mat->rowp[0])[i] = r - RAND_MAX / 2;                 break;
+      case ELEM_INT64:  ((int64_t *) mat->rowp[0])[i] = ((int64_t) r << 31) ^ rand();     break;
+      case ELEM_FLOAT:  ((float *) mat->rowp[0])[i] = r / (float) RAND_MAX - 0.5f;       break;
+      case ELEM_DOUBLE: ((double *) mat->rowp[0])[i] = r / (double) RAND_MAX - 0.5;      break;
+      default:          break;
+    }
+  }
+}
+
+static int random_dim(int cutoff)
+{
+  // Small cutoffs recurse deeply; keep those shapes small
+  int max = cutoff < 8 ? 48 : CHECK_MAX_DIM;
+  return 1 + rand() % max;
+}
+
+int main(int argc, char *argv[])
+{
+  int shapes = argc > 1 ? atoi(argv[1]) : 20;
+  unsigned seed = argc > 2 ? (unsigned) atoi(argv[2]) : 422;
+  int failures = 0;
+  int checked = 0;
+  int t, c, s;
+
+  srand(seed);
+  for (t = 0; t < ELEM_TYPE_COUNT; t++)
+  {
+    for (c = 0; c < (int) (sizeof(cutoffs) / sizeof(cutoffs[0])); c++)
+    {
+      for (s = 0; s < shapes; s++)
+      {
+        int m = random_dim(cutoffs[c]);
+        int k = random_dim(cutoffs[c]);
+        int n = random_dim(cutoffs[c]);
+        // Every other shape is square and above the cutoff, so the
+        // recursive path is always taken some of the time
+        if (s % 2 == 0)
+          m = k = n = cutoffs[c] * 2 + 1 + rand() % (cutoffs[c] + 1);
+        Matrix * a = AllocMatrixOfType(m, k, (ElemType) t);
+        Matrix * b = AllocMatrixOfType(k, n, (ElemType) t);
+        fill_random(a);
+        fill_random(b);
+
+        MULTIPLY_CUTOFF = 0;
+        Matrix * want = MatrixMultiply(a, b);
+        MULTIPLY_CUTOFF = cutoffs[c];
+        Matrix * got = MatrixMultiply(a, b);
+
+        size_t bytes = (size_t) m * n * ElemSize((ElemType) t);
+        if (memcmp(want->rowp[0], got->rowp[0], bytes) != 0)
+        {
+          printf("MISMATCH %s (%d x %d) BY (%d x %d) cutoff=%d\n",
+                 ElemTypeName((ElemType) t), m, k, k, n, cutoffs[c]);
+          failures++;
+        }
+        checked++;
+        FreeMatrix(want);
+        FreeMatrix(got);
+        FreeMatrix(a);
+        FreeMatrix(b);
+      }
+    }
+  }
+  FreeMatrixWorkspace();
+
+  printf("matrix_check: %d products checked, %d mismatches\n", checked, failures);
+  return failures > 0;
+}
@@ -0,0 +1,131 @@
+/*
+ *  pcconsumer module
+ *  Standalone remote consumer for the pcMatrix program
+ *
+ *  Connects to a pcMatrix started with PCMATRIX_TRANSPORT, receives
+ *  batches of matrices and runs the same pairing as cons_worker: a
+ *  matrix is held as A until the next one arrives, the two are multiplied
+ *  if their shapes allow it, otherwise A is dropped and the new matrix
+ *  becomes A.  Each freed matrix returns a credit to pcMatrix, and the
+ *  totals are sent back at the end for displayStats.
+ *
+ *  usage: pcConsumer [unix:path | tcp:host:port]
+ *
+ *  University of Washington, Tacoma
+ *  TCSS 422 - Operating Systems
+ *  Spring 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "matrix.h"
+#include "pcmatrix.h"
+#include "transport.h"
+
+int main(int argc, char *argv[]) {
+  const char *address = argc > 1 ? argv[1] : getenv(TRANSPORT_ENV);
+  frame_buf_t in = { NULL, 0, 0 };
+  remote_stats_t stats = { 0, 0, 0 };
+  remote_stats_t reported = { 0, 0, 0 };
+  Matrix *matrix_A = NULL;
+  FrameType type;
+  uint32_t window;
+  int32_t cutoff;
+
+  if (address == NULL) {
+    printf("usage: %s [unix:path | tcp:host:port]\n", argv[0]);
+    return 1;
+  }
+  int fd = transport_connect(address);
+  if (fd < 0)
+    return 1;
+
+  // The producer side picks the window and the multiply configuration
+  if (recv_frame(fd, &in, &type) != 0 || type != FRAME_HELLO || in.len < 8) {
+    printf("pcConsumer: no HELLO from %s\n", address);
+    return 1;
+  }
+  memcpy(&window, in.data, 4);
+  memcpy(&cutoff, in.data + 4, 4);
+  MULTIPLY_CUTOFF = cutoff;
+  printf("pcConsumer: connected to %s, window=%u\n", address, window);
+  credit_msg_t credit = { window, 0, 0, 0 };
+  if (send_frame(fd, FRAME_CREDIT, &credit, sizeof(credit)) != 0)
+    return 1;
+
+  for (;;) {
+    if (recv_frame(fd, &in, &type) != 0) {
+      printf("pcConsumer: connection lost\n");
+      return 1;
+    }
+    if (type == FRAME_END)
+      break;
+    if (type != FRAME_BATCH || in.len < 4)
+      continue;
+
+    uint32_t count, i;
+    uint32_t freed = 0;
+    const char *p = in.data + 4;
+    const char *end = in.data + in.len;
+    memcpy(&count, in.data, 4);
+    for (i = 0; i < count; i++) {
+      Matrix *matrix_B = UnpackMatrix(&p, end);
+      if (matrix_B == NULL) {
+        printf("pcConsumer: bad or short batch\n");
+        return 1;
+      }
+      stats.matrices++;
+      if (matrix_A == NULL) {
+        matrix_A = matrix_B;
+        continue;
+      }
+      Matrix *multiplied = MatrixMultiply(matrix_A, matrix_B);
+      if (multiplied != NULL) {
+        stats.multiplied++;
+        stats.sumtotal += SumMatrix(multiplied);
+#if OUTPUT
+        DisplayMatrix(matrix_A, stdout);
+        printf("    X\n");
+        DisplayMatrix(matrix_B, stdout);
+        printf("    =\n");
+        DisplayMatrix(multiplied, stdout);
+        printf("\n");
+        printf("----------------------------\n");
+#endif
+        FreeMatrix(multiplied);
+        FreeMatrix(matrix_A);
+        FreeMatrix(matrix_B);
+        matrix_A = NULL;
+        freed += 2;
+      } else {
+        FreeMatrix(matrix_A);
+        matrix_A = matrix_B;
+        freed++;
+      }
+    }
+    if (freed > 0) {
+      // Report the products since the last credit with it
+      credit.credits = freed;
+      credit.multiplied = stats.multiplied - reported.multiplied;
+      credit.sumtotal = stats.sumtotal - reported.sumtotal;
+      if (send_frame(fd, FRAME_CREDIT, &credit, sizeof(credit)) != 0)
+        return 1;
+      reported = stats;
+    }
+  }
+
+  if (matrix_A != NULL)
+    FreeMatrix(matrix_A);
+  FreeMatrixWorkspace();
+  send_frame(fd, FRAME_STATS, &stats, sizeof(stats));
+  close(fd);
+  frame_buf_free(&in);
+
+  printf("pcConsumer: matrices=%lld multiplied=%lld sum=%lld\n",
+         (long long) stats.matrices, (long long) stats.multiplied, (long long) stats.sumtotal);
+  return 0;
+}
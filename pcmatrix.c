@@ -37,6 +37,8 @@
 #include "counter.h"
 #include "prodcons.h"
 #include "pcmatrix.h"
+#include "telemetry.h"
+#include "transport.h"
 #include <semaphore.h>
 
 void init_ProdConStats(ProdConsStats *pcs);
@@ -46,6 +48,11 @@ int main(int argc, char *argv[]) {
   // Process command line arguments
   int numw = NUMWORK;
 
+  BOUNDED_BUFFER_BYTES = MAX_BYTES;
+  MATRIX_TYPE = DEFAULT_MATRIX_TYPE;
+  MATRIX_DENSITY = DEFAULT_MATRIX_DENSITY;
+  MULTIPLY_CUTOFF = DEFAULT_MULTIPLY_CUTOFF;
+
   if (argc == 1) {
     BOUNDED_BUFFER_SIZE = MAX;
     NUMBER_OF_MATRICES = LOOPS;
@@ -71,14 +78,35 @@ int main(int argc, char *argv[]) {
       NUMBER_OF_MATRICES = atoi(argv[3]);
       MATRIX_MODE = DEFAULT_MATRIX_MODE;
     }
-    if (argc == 5) {
+    if (argc >= 5) {
       numw = atoi(argv[1]);
       BOUNDED_BUFFER_SIZE = atoi(argv[2]);
       NUMBER_OF_MATRICES = atoi(argv[3]);
       MATRIX_MODE = atoi(argv[4]);
     }
-    printf("USING: worker_threads=%d bounded_buffer_size=%d matricies=%d matrix_mode=%d\n", numw,
-           BOUNDED_BUFFER_SIZE, NUMBER_OF_MATRICES, MATRIX_MODE);
+    if (argc >= 6) {
+      BOUNDED_BUFFER_BYTES = atol(argv[5]);
+    }
+    if (argc >= 7) {
+      MATRIX_TYPE = ParseElemType(argv[6]);
+      if (MATRIX_TYPE < 0) {
+        printf("Unknown matrix type '%s', use int32, int64, float or double\n", argv[6]);
+        return 1;
+      }
+    }
+    if (argc >= 8) {
+      MATRIX_DENSITY = atof(argv[7]);
+      if (MATRIX_DENSITY <= 0.0 || MATRIX_DENSITY > 1.0) {
+        printf("Matrix density must be in (0, 1]\n");
+        return 1;
+      }
+    }
+    if (argc >= 9) {
+      MULTIPLY_CUTOFF = atoi(argv[8]);
+    }
+    printf("USING: worker_threads=%d bounded_buffer_size=%d matricies=%d matrix_mode=%d bounded_buffer_bytes=%ld matrix_type=%s matrix_density=%g multiply_cutoff=%d\n",
+           numw, BOUNDED_BUFFER_SIZE, NUMBER_OF_MATRICES, MATRIX_MODE, BOUNDED_BUFFER_BYTES, ElemTypeName(MATRIX_TYPE),
+           MATRIX_DENSITY, MULTIPLY_CUTOFF);
   }
 
   // Create space for the buffer and clear it
@@ -109,12 +137,53 @@ int main(int argc, char *argv[]) {
 
 
 
-  printf("Producing %d matrices in mode %d.\n", NUMBER_OF_MATRICES, MATRIX_MODE);
+  printf("Producing %d %s matrices in mode %d.\n", NUMBER_OF_MATRICES, ElemTypeName(MATRIX_TYPE), MATRIX_MODE);
   printf("Using a shared buffer of size=%d\n", BOUNDED_BUFFER_SIZE);
+  if (MATRIX_DENSITY < 1.0)
+    printf("Sparse (CSR) matrices with density %g\n", MATRIX_DENSITY);
+  if (BOUNDED_BUFFER_BYTES > 0)
+    printf("Limited to %ld bytes of matrices in flight\n", BOUNDED_BUFFER_BYTES);
   printf("With %d producer and consumer thread(s).\n", numw);
   printf("\n");
 
 
+  // Remote consumers, if asked for in the environment.  They replace the
+  // local consumer threads and split BOUNDED_BUFFER_SIZE between them as
+  // their credit windows.
+  char *transport = getenv(TRANSPORT_ENV);
+  int nremote = 0;
+  remote_args_t *remote = NULL;
+  pthread_t *rid = NULL;
+  if (transport != NULL && *transport != 0) {
+    char *env = getenv(REMOTE_CONSUMERS_ENV);
+    nremote = env != NULL && atoi(env) > 0 ? atoi(env) : 1;
+    int window = BOUNDED_BUFFER_SIZE / nremote < 2 ? 2 : BOUNDED_BUFFER_SIZE / nremote;
+    int lfd = transport_listen(transport);
+    if (lfd < 0)
+      return 1;
+    printf("Waiting for %d remote consumer(s) on %s\n", nremote, transport);
+    remote = (remote_args_t*) malloc(sizeof(remote_args_t) * nremote);
+    rid = (pthread_t*) malloc(sizeof(pthread_t) * nremote);
+    for (i = 0; i < nremote; i++) {
+      remote[i].params = params;
+      remote[i].fd = transport_accept(lfd);
+      remote[i].window = window;
+      remote[i].total = NUMBER_OF_MATRICES * ((numw + 1) / 2);
+      if (remote[i].fd < 0) {
+        perror("accept");
+        return 1;
+      }
+    }
+    transport_unlisten(lfd, transport);
+  }
+
+  // Ring slots, with room for what the consumers hold: A and B for each
+  // local consumer, a batch being packed for each remote worker
+  init_slots(nremote > 0 ? nremote * TRANSPORT_BATCH : ((numw + 1) / 2) * 2);
+
+  // Live telemetry, if asked for in the environment
+  telemetry_start(params);
+
   pthread_t *pid; // Producer and consumer threads
   pid = (pthread_t*)malloc(sizeof(pthread_t) * (numw * 2));
 
@@ -122,16 +191,39 @@ int main(int argc, char *argv[]) {
     // Create the producer and consumer threads
 
     pthread_create(&pid[i], NULL, prod_worker, (void*) params);
-    pthread_create(&pid[i + 1], NULL, cons_worker, (void*) params);
+    if (nremote == 0)
+      pthread_create(&pid[i + 1], NULL, cons_worker, (void*) params);
+  }
+  init_remote_workers(nremote);
+  for (i = 0; i < nremote; i++) {
+    pthread_create(&rid[i], NULL, remote_worker, (void*) &remote[i]);
   }
 
   // Join the consumes and producers back up with the main process
   for (i = 0; i < numw; i+=2) {
     pthread_join(pid[i], NULL);
-    pthread_join(pid[i+1], NULL);
+    if (nremote == 0)
+      pthread_join(pid[i+1], NULL);
+  }
+  for (i = 0; i < nremote; i++) {
+    pthread_join(rid[i], NULL);
   }
 
+  telemetry_stop();
   displayStats(params);
+  free_slots();
+
+  if (get_run_aborted()) {
+    printf("Run aborted: every remote consumer was lost\n");
+    return 1;
+  }
+  long lost;
+  int failed = get_remote_failed(&lost);
+  if (failed > 0) {
+    printf("Run failed: %d remote consumer(s) lost, their totals are missing and %ld matrices sent to them were never processed\n",
+           failed, lost);
+    return 1;
+  }
 
   printf("Finished running program!");
 
@@ -149,8 +241,9 @@ void displayStats(const thread_args_t *params) {// Variables used to display the
   int cos = params->counters->cons->value;
   int prodtot = params->prodConStats->matrixtotal;
   int constot = params->prodConStats->multtotal;
-  int consmul = params->prodConStats->sumtotal;
+  long long consmul = params->prodConStats->sumtotal;
 
   printf("Sum of Matrix elements --> Produced=%d = Consumed=%d\n", prs, cos);
-  printf("Matrices produced=%d consumed=%d multiplied=%d\n", prodtot, constot, consmul);
+  printf("Matrices produced=%d consumed=%d multiplied=%lld\n", prodtot, constot, consmul);
+  printf("Matrix bytes in flight=%ld peak=%ld\n", get_inflight_bytes(), get_peak_bytes());
 }
\ No newline at end of file
@@ -11,12 +11,21 @@
 #define NUMWORK 1
 
 // Constant for enabling and disabling DEBUG output
+// Builds that only want their own results, like matrix_check, pass
+// -DOUTPUT=0
+#ifndef OUTPUT
 #define OUTPUT 1
+#endif
 
 // Size of the buffer ARRAY  (see ch. 30, section 2, producer/consumer)
 #define MAX 200
 int BOUNDED_BUFFER_SIZE;
 
+// Byte budget for matrices in flight (produced but not yet freed)
+// 0 - no byte limit, only BOUNDED_BUFFER_SIZE slots apply
+#define MAX_BYTES 0
+long BOUNDED_BUFFER_BYTES;
+
 // Number of matrices to produce/consume
 #define LOOPS 5
 int NUMBER_OF_MATRICES;
@@ -27,6 +36,27 @@ int NUMBER_OF_MATRICES;
 #define DEFAULT_MATRIX_MODE 0
 int MATRIX_MODE;
 
+// Largest number of rows or cols of a mode 0 matrix
+#define RANDOM_MATRIX_MAX 4
+
+// MATRIX ELEMENT TYPE
+// One of the ElemType values in matrix.h: int32, int64, float or double
+#define DEFAULT_MATRIX_TYPE ELEM_INT32
+int MATRIX_TYPE;
+
+// MATRIX DENSITY
+// Fraction of nonzero elements.  1.0 generates dense matrices, anything
+// lower generates sparse (CSR) matrices with that expected density.
+#define DEFAULT_MATRIX_DENSITY 1.0
+double MATRIX_DENSITY;
+
+// MULTIPLY CUTOFF
+// Dense products with every dimension above this recurse (Strassen-
+// Winograd for int32/int64, blocked halving for float/double) down to
+// blocks of at most this size.  0 always uses the plain loops.
+#define DEFAULT_MULTIPLY_CUTOFF 128
+int MULTIPLY_CUTOFF;
+
 #include "prodcons.h"
 #include "counter.h"
 
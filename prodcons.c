@@ -13,12 +13,18 @@
 // Include only libraries for this module
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include "counter.h"
 #include "matrix.h"
+#include "sparse.h"
 #include "pcmatrix.h"
 #include "prodcons.h"
+#include "telemetry.h"
+#include "transport.h"
 
 
 // Define Locks and Condition variables here
@@ -35,11 +41,234 @@ counter_t *counter;
 // Bounded buffer bigmatrix defined in prodcons.h
 Matrix ** bigmatrix;
 
+// Bytes held by matrices in flight (produced but not yet freed) and the
+// high water mark, both protected by mutex
+long inflight_bytes = 0;
+long peak_bytes = 0;
+
+// Ring slots, protected by mutex.  Each slot owns the storage for one
+// matrix of up to slot_dim x slot_dim elements, allocated the first time
+// the slot is used and kept after that, so producers generate straight
+// into it and consumers read it in place.  bigmatrix orders the
+// committed slots.  free_slot is a stack: the slot reserved next is the
+// one released last, whose storage is most likely still in cache, and
+// only as many slots ever get storage as are in use at once.
+Matrix *slots = NULL;
+int *free_slot = NULL;
+int nslots = 0;
+int nfree = 0;
+int reserved_slots = 0;
+int slot_dim = 0;
+
+// Remote workers still connected, whether the run was abandoned
+// because the last of them lost its pcConsumer, and how many workers
+// ended without their consumer's totals along with the matrices those
+// consumers took but never credited back.  All protected by mutex.
+int remote_alive = 0;
+int run_aborted = 0;
+int remote_failed = 0;
+long remote_lost = 0;
+
 void init_buffer_size_counter() {
   counter = (counter_t*) malloc(sizeof(counter_t));
   init_cnt(counter);
 }
 
+// Block until bytes more can be put in flight, then charge them.
+// Only a non-empty buffer holds a producer back: a consumer holding
+// matrix A while it waits for a B has to get one, so the budget can be
+// overshot by what the consumers hold, but it can not deadlock.
+void reserve_bytes(long bytes) {
+  pthread_mutex_lock(&mutex);
+  while (BOUNDED_BUFFER_BYTES > 0 && get_cnt(counter) > 0 && !run_aborted &&
+         inflight_bytes + bytes > BOUNDED_BUFFER_BYTES) {
+    telemetry_state(STATE_WAIT_BYTES);
+    pthread_cond_wait(&empty, &mutex);
+  }
+  telemetry_state(STATE_RUNNING);
+  inflight_bytes += bytes;
+  if (inflight_bytes > peak_bytes)
+    peak_bytes = inflight_bytes;
+  pthread_mutex_unlock(&mutex);
+}
+
+// Return the bytes of a freed matrix to the budget
+void release_bytes(long bytes) {
+  pthread_mutex_lock(&mutex);
+  inflight_bytes -= bytes;
+  // Producers waiting on bytes and on slots share the empty condition
+  pthread_cond_broadcast(&empty);
+  pthread_mutex_unlock(&mutex);
+}
+
+// Correct a reservation made from an estimate, without blocking
+void adjust_bytes(long delta) {
+  if (delta == 0)
+    return;
+  pthread_mutex_lock(&mutex);
+  inflight_bytes += delta;
+  if (inflight_bytes > peak_bytes)
+    peak_bytes = inflight_bytes;
+  if (delta < 0)
+    pthread_cond_broadcast(&empty);
+  pthread_mutex_unlock(&mutex);
+}
+
+int get_buffer_depth() {
+  return get_cnt(counter);
+}
+
+long get_inflight_bytes() {
+  pthread_mutex_lock(&mutex);
+  long rc = inflight_bytes;
+  pthread_mutex_unlock(&mutex);
+  return rc;
+}
+
+long get_peak_bytes() {
+  pthread_mutex_lock(&mutex);
+  long rc = peak_bytes;
+  pthread_mutex_unlock(&mutex);
+  return rc;
+}
+
+// Called before the remote workers start, so one losing its connection
+// early can't look like the last one
+void init_remote_workers(int n) {
+  pthread_mutex_lock(&mutex);
+  remote_alive = n;
+  pthread_mutex_unlock(&mutex);
+}
+
+int get_run_aborted() {
+  pthread_mutex_lock(&mutex);
+  int rc = run_aborted;
+  pthread_mutex_unlock(&mutex);
+  return rc;
+}
+
+// Remote workers that didn't finish cleanly; the matrices they sent
+// without getting credit back are stored in *lost
+int get_remote_failed(long *lost) {
+  pthread_mutex_lock(&mutex);
+  int rc = remote_failed;
+  *lost = remote_lost;
+  pthread_mutex_unlock(&mutex);
+  return rc;
+}
+
+// Slots for the buffer plus held, the most matrices the consumers can
+// hold outside it at once.  A consumer waits for B holding A in its
+// slot, so with fewer slots the producers could be starved of one.
+// Headers are cheap; storage is only allocated on use.
+void init_slots(int held) {
+  int i;
+  slot_dim = MATRIX_MODE > 0 ? MATRIX_MODE : RANDOM_MATRIX_MAX;
+  nslots = BOUNDED_BUFFER_SIZE + held;
+  slots = (Matrix*) calloc(nslots, sizeof(Matrix));
+  free_slot = (int*) malloc(sizeof(int) * nslots);
+  assert(slots != 0 && free_slot != 0);
+  for (i = 0; i < nslots; i++) {
+    free_slot[i] = nslots - 1 - i;
+  }
+  nfree = nslots;
+}
+
+// Index of the slot holding mat, -1 for a matrix with its own allocation
+static int slot_of(Matrix *mat) {
+  if (slots != NULL && mat >= slots && mat < slots + nslots)
+    return mat - slots;
+  return -1;
+}
+
+static int slot_empty(Matrix *mat) {
+  return mat->rowp == NULL && mat->csr.rowptr == NULL;
+}
+
+// Give the storage of a slot allocated matrix to the slot header
+static void adopt_storage(Matrix *slot, Matrix *mat) {
+  *slot = *mat;
+  free(mat);
+}
+
+void free_slots() {
+  int i;
+  for (i = 0; i < nslots; i++) {
+    if (!slot_empty(&slots[i])) {
+      Matrix *mat = (Matrix*) malloc(sizeof(Matrix));
+      assert(mat != 0);
+      *mat = slots[i];
+      FreeMatrix(mat);
+    }
+  }
+  free(slots);
+  free(free_slot);
+  slots = NULL;
+  nslots = 0;
+  nfree = 0;
+}
+
+// Reserve a slot for a row x col matrix of MATRIX_TYPE and return its
+// matrix, ready for GenMatrix (or GenSparse when MATRIX_DENSITY < 1).
+// Blocks while the buffer is full, counting slots reserved but not yet
+// committed.  Returns NULL once the run has been aborted.
+Matrix *reserve_slot(int row, int col) {
+  pthread_mutex_lock(&mutex);
+  while ((get_cnt(counter) + reserved_slots >= BOUNDED_BUFFER_SIZE || nfree == 0) && !run_aborted) {
+    telemetry_state(STATE_WAIT_SLOT);
+    pthread_cond_wait(&empty, &mutex);
+  }
+  telemetry_state(STATE_RUNNING);
+  if (run_aborted) {
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+  }
+  Matrix *mat = &slots[free_slot[--nfree]];
+  reserved_slots++;
+  pthread_mutex_unlock(&mutex);
+
+  // The slot is ours until commit, so its storage is set up unlocked
+  if (MATRIX_DENSITY < 1.0) {
+    if (slot_empty(mat)) {
+      long expect = (long) (MATRIX_DENSITY * slot_dim * slot_dim);
+      adopt_storage(mat, AllocSparse(slot_dim, slot_dim, MATRIX_TYPE, expect + expect / 8 + slot_dim));
+    }
+    mat->rows = row;
+    mat->cols = col;
+  } else {
+    if (slot_empty(mat))
+      adopt_storage(mat, AllocMatrixOfType(slot_dim, slot_dim, MATRIX_TYPE));
+    ShapeMatrix(mat, row, col);
+  }
+  return mat;
+}
+
+// Publish a generated slot to the consumers
+void commit_slot(Matrix *value, void *args) {
+  pthread_mutex_lock(&mutex);
+  put(value, args);
+  reserved_slots--;
+  pthread_cond_signal(&fill);
+  pthread_mutex_unlock(&mutex);
+}
+
+// Release a matrix taken from the buffer: its bytes go back to the
+// budget and its slot, if it still has one, back to the producers.
+// Matrices with an allocation of their own are freed.
+void release_slot(Matrix *mat) {
+  long bytes = MatrixFootprint(mat);
+  int slot = slot_of(mat);
+  if (slot < 0)
+    FreeMatrix(mat);
+  pthread_mutex_lock(&mutex);
+  inflight_bytes -= bytes;
+  if (slot >= 0)
+    free_slot[nfree++] = slot;
+  // Producers waiting on bytes and on slots share the empty condition
+  pthread_cond_broadcast(&empty);
+  pthread_mutex_unlock(&mutex);
+}
+
 // Bounded buffer put() get()
 int put(Matrix *value, void *args) {
   thread_args_t *params = (thread_args_t*) args;
@@ -51,10 +280,13 @@ int put(Matrix *value, void *args) {
 
 Matrix *get(void *args) {
   thread_args_t *params = (thread_args_t*) args;
-  use_ptr = get_cnt(params->counters->cons);
+  use_ptr = get_cnt(params->counters->cons) % BOUNDED_BUFFER_SIZE;
   Matrix *tmp_matrix = bigmatrix[use_ptr];
   increment_cnt(params->counters->cons);
   decrement_cnt(counter);
+  // Wake producers blocked on a full buffer or on bytes; the consumer
+  // may go on to wait for B, which only they can provide
+  pthread_cond_broadcast(&empty);
   return tmp_matrix;
 }
 
@@ -62,6 +294,7 @@ Matrix *get(void *args) {
 void *prod_worker(void *arg) {
   printf("prod_worker is running!\n");
   thread_args_t *params = (thread_args_t*) arg;
+  telemetry_register("producer");
 
 #if OUTPUT
   printf("In worker...\n");
@@ -69,58 +302,85 @@ void *prod_worker(void *arg) {
 #endif
   int i;
   for (i = 0; i < NUMBER_OF_MATRICES; i++) {
-    Matrix *value = GenMatrixRandom();
-    pthread_mutex_lock(&mutex);
-    while (get_cnt(counter) == BOUNDED_BUFFER_SIZE) {
-      pthread_cond_wait(&empty, &mutex);
+    int row = MATRIX_MODE;
+    int col = MATRIX_MODE;
+    if (MATRIX_MODE == 0) {
+      row = 1 + rand() % RANDOM_MATRIX_MAX;
+      col = 1 + rand() % RANDOM_MATRIX_MAX;
+    }
+    // Wait for byte budget before taking a slot, not after
+    Matrix *value;
+    if (MATRIX_DENSITY < 1.0) {
+      // Charge the expected size, then settle up once the nonzeros are known
+      long expect = SparseBytes(row, col, MATRIX_TYPE, MATRIX_DENSITY);
+      reserve_bytes(expect);
+      value = reserve_slot(row, col);
+      if (value == NULL) {
+        release_bytes(expect);
+        break;
+      }
+      GenSparse(value, MATRIX_DENSITY);
+      adjust_bytes(MatrixFootprint(value) - expect);
+    } else {
+      reserve_bytes(MatrixBytes(row, col, MATRIX_TYPE));
+      value = reserve_slot(row, col);
+      if (value == NULL) {
+        release_bytes(MatrixBytes(row, col, MATRIX_TYPE));
+        break;
+      }
+      GenMatrix(value);
     }
 
 #if OUTPUT
     DisplayMatrix(value, stdout);
 #endif
-    put(value, params);
-    pthread_cond_signal(&fill);
-    pthread_mutex_unlock(&mutex);
+    commit_slot(value, params);
   }
   params->prodConStats->matrixtotal = get_cnt(params->counters->prod);
+  telemetry_state(STATE_DONE);
   return NULL;
 }
 
 // Matrix CONSUMER worker thread
+// Matrices are read in place in their ring slots.  A is paired with the
+// next matrix in the buffer only if they can be multiplied; otherwise A
+// is released on its own, as before.
 void *cons_worker(void *arg) {
   thread_args_t *params = (thread_args_t *) arg;
   Matrix *multiplied = NULL;
   Matrix *matrix_A = NULL;
   Matrix *matrix_B = NULL;
+  telemetry_register("consumer");
 
   while (get_cnt(params->counters->cons) < NUMBER_OF_MATRICES) {
     pthread_mutex_lock(&mutex);
 
     while (get_cnt(counter) == 0) {
+      telemetry_state(STATE_WAIT_FILL);
       pthread_cond_wait(&fill, &mutex);
     }
 
+    matrix_A = get(arg);
 
-    Matrix *matrix_A = get(arg);
-    if (NULL == matrix_A) {
-      printf("");
-    }
-
+    // A stays in its slot; init_slots left room for it
     while (get_cnt(counter) == 0 && get_cnt(params->counters->cons) < NUMBER_OF_MATRICES) {
+      telemetry_state(STATE_WAIT_FILL);
       pthread_cond_wait(&fill, &mutex);
     }
+    telemetry_state(STATE_RUNNING);
+
+    // Take B only if it fits A, leaving it for the next A otherwise
+    use_ptr = get_cnt(params->counters->cons) % BOUNDED_BUFFER_SIZE;
+    if (get_cnt(counter) > 0 && matrix_A->cols == bigmatrix[use_ptr]->rows) {
+      matrix_B = get(arg);
+    }
     pthread_cond_signal(&empty);
     pthread_mutex_unlock(&mutex);
 
-    use_ptr = get_cnt(params->counters->cons) % BOUNDED_BUFFER_SIZE;
-    if (get_cnt(params->counters->prod) - get_cnt(params->counters->cons) > 0) {
-      multiplied = MatrixMultiply(matrix_A, bigmatrix[use_ptr]);
+    if (matrix_B != NULL) {
+      multiplied = MatrixMultiply(matrix_A, matrix_B);
     }
     if (multiplied != NULL) {
-      pthread_mutex_lock(&mutex);
-      Matrix *matrix_B = get(arg);
-      pthread_cond_signal(&empty);
-      pthread_mutex_unlock(&mutex);
       params->prodConStats->multtotal++;
       params->prodConStats->sumtotal += SumMatrix(multiplied);
 
@@ -133,22 +393,179 @@ void *cons_worker(void *arg) {
       printf("\n");
       printf("----------------------------\n");
 #endif
-      if (matrix_B != NULL) {
-      FreeMatrix(matrix_B);
-      matrix_B = NULL;
-      }
-      if (multiplied != NULL) {
       FreeMatrix(multiplied);
       multiplied = NULL;
-      }
+    }
+    if (matrix_B != NULL) {
+      release_slot(matrix_B);
+      matrix_B = NULL;
     }
 
     if (matrix_A != NULL) {
-      FreeMatrix(matrix_A);
+      release_slot(matrix_A);
       matrix_A = NULL;
     }
 
   }
 
+  FreeMatrixWorkspace();
+  telemetry_state(STATE_DONE);
+
+  return NULL;
+}
+
+// Matrix REMOTE worker thread
+// Takes matrices from the bounded buffer like cons_worker, but ships them
+// in batches to a pcConsumer process instead of multiplying them here.
+// Batches never outrun the credits the remote side has granted.
+void *remote_worker(void *arg) {
+  remote_args_t *remote = (remote_args_t *) arg;
+  thread_args_t *params = remote->params;
+  Matrix *batch[TRANSPORT_BATCH];
+  frame_buf_t out = { NULL, 0, 0 };
+  frame_buf_t in = { NULL, 0, 0 };
+  FrameType type;
+  uint32_t credits = 0;
+  long sent = 0;        // matrices sent
+  long granted = 0;     // credits received, the initial window included
+  remote_stats_t counted = { 0, 0, 0 };   // products already in prodConStats
+  int finished = 0;     // set once the consumer's totals are in
+  int done = 0;
+  int count, i;
+  telemetry_register("remote");
+
+  uint32_t hello[2] = { remote->window, MULTIPLY_CUTOFF };
+  if (send_frame(remote->fd, FRAME_HELLO, hello, sizeof(hello)) != 0)
+    done = -1;
+
+  while (done == 0) {
+    // Collect returned credits, blocking only when there are none
+    while (credits == 0 || transport_readable(remote->fd, 0)) {
+      telemetry_state(STATE_WAIT_CREDIT);
+      if (recv_frame(remote->fd, &in, &type) != 0) {
+        done = -1;
+        break;
+      }
+      if (type == FRAME_CREDIT && in.len >= sizeof(credit_msg_t)) {
+        credit_msg_t credit;
+        memcpy(&credit, in.data, sizeof(credit));
+        credits += credit.credits;
+        granted += credit.credits;
+        // Count the remote products as they are reported
+        if (credit.multiplied != 0 || credit.sumtotal != 0) {
+          pthread_mutex_lock(&mutex);
+          params->prodConStats->multtotal += credit.multiplied;
+          params->prodConStats->sumtotal += credit.sumtotal;
+          pthread_mutex_unlock(&mutex);
+          counted.multiplied += credit.multiplied;
+          counted.sumtotal += credit.sumtotal;
+        }
+      }
+      // Never more in flight than the window, whatever the peer says
+      if (credits > (uint32_t) remote->window)
+        credits = remote->window;
+    }
+    telemetry_state(STATE_RUNNING);
+    if (done != 0)
+      break;
+
+    // Wait for one matrix, then take whatever else is ready
+    count = 0;
+    pthread_mutex_lock(&mutex);
+    while (get_cnt(counter) == 0 && get_cnt(params->counters->cons) < remote->total) {
+      telemetry_state(STATE_WAIT_FILL);
+      pthread_cond_wait(&fill, &mutex);
+    }
+    telemetry_state(STATE_RUNNING);
+    while (count < TRANSPORT_BATCH && count < (int) credits && get_cnt(counter) > 0 &&
+           get_cnt(params->counters->cons) < remote->total) {
+      batch[count++] = get(params);
+    }
+    if (get_cnt(params->counters->cons) >= remote->total) {
+      // Wake the other remote workers so they see the end too
+      pthread_cond_broadcast(&fill);
+      done = 1;
+    }
+    pthread_cond_broadcast(&empty);
+    pthread_mutex_unlock(&mutex);
+
+    if (count == 0)
+      continue;
+    // Pack the batch, starting a new frame wherever the next matrix
+    // would take it over TRANSPORT_MAX_FRAME
+    uint32_t n = 0;
+    for (i = 0; i < count; i++) {
+      size_t bytes = PackedBytes(batch[i]);
+      if (n > 0 && out.len + bytes > TRANSPORT_MAX_FRAME) {
+        memcpy(out.data, &n, sizeof(n));
+        if (done >= 0 && send_frame(remote->fd, FRAME_BATCH, out.data, out.len) != 0)
+          done = -1;
+        n = 0;
+      }
+      if (n == 0) {
+        out.len = 0;
+        if (frame_buf_append(&out, &n, sizeof(n)) != 0)
+          done = -1;
+      }
+      if (sizeof(n) + bytes > TRANSPORT_MAX_FRAME) {
+        printf("remote_worker: a %zu byte matrix is over the frame limit\n", bytes);
+        done = -1;
+      } else if (done >= 0 && PackMatrix(batch[i], &out) != 0) {
+        printf("remote_worker: out of memory packing a %zu byte matrix\n", bytes);
+        done = -1;
+      } else {
+        n++;
+      }
+      release_slot(batch[i]);
+    }
+    credits -= count;
+    sent += count;
+    if (n > 0 && done >= 0) {
+      memcpy(out.data, &n, sizeof(n));
+      if (done >= 0 && send_frame(remote->fd, FRAME_BATCH, out.data, out.len) != 0)
+        done = -1;
+    }
+  }
+
+  // Tell the remote side to finish and wait for its totals
+  if (done == 1 && send_frame(remote->fd, FRAME_END, NULL, 0) == 0) {
+    while (recv_frame(remote->fd, &in, &type) == 0) {
+      if (type == FRAME_STATS && in.len >= sizeof(remote_stats_t)) {
+        remote_stats_t stats;
+        memcpy(&stats, in.data, sizeof(stats));
+        // Only what the CREDIT frames haven't already reported
+        pthread_mutex_lock(&mutex);
+        params->prodConStats->multtotal += stats.multiplied - counted.multiplied;
+        params->prodConStats->sumtotal += stats.sumtotal - counted.sumtotal;
+        pthread_mutex_unlock(&mutex);
+        finished = 1;
+        break;
+      }
+    }
+  }
+  if (!finished)
+    printf("remote_worker: lost connection to remote consumer\n");
+
+  // With no remote workers left nothing will drain the buffer, so
+  // release the producers instead of leaving them blocked
+  pthread_mutex_lock(&mutex);
+  if (!finished) {
+    // Whatever was sent and not credited back died with the consumer
+    long unacked = sent - (granted - remote->window);
+    remote_failed++;
+    remote_lost += unacked > 0 ? unacked : 0;
+  }
+  remote_alive--;
+  if (done < 0 && remote_alive == 0) {
+    run_aborted = 1;
+    pthread_cond_broadcast(&empty);
+    pthread_cond_broadcast(&fill);
+  }
+  pthread_mutex_unlock(&mutex);
+
+  close(remote->fd);
+  frame_buf_free(&out);
+  frame_buf_free(&in);
+  telemetry_state(STATE_DONE);
   return NULL;
 }
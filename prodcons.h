@@ -21,7 +21,7 @@ Matrix ** bigmatrix;
 // multtotal - total number of matrices multiplied
 // matrixtotal - total number of matrices produced or consumed
 typedef struct prodcons {
-  int sumtotal;
+  long long sumtotal;
   int multtotal;
   int matrixtotal;
 } ProdConsStats;
@@ -31,14 +31,47 @@ typedef struct thread_args {
     ProdConsStats *prodConStats;
 } thread_args_t;
 
+// Arguments for a remote_worker: the pcConsumer connection, its credit
+// window, and how many matrices the whole run consumes
+typedef struct remote_args {
+    thread_args_t *params;
+    int fd;
+    int window;
+    int total;
+} remote_args_t;
+
 // PRODUCER-CONSUMER thread method function prototypes
 void *prod_worker(void *arg);
 void *cons_worker(void *arg);
+void *remote_worker(void *arg);
 
 // Routines to add and remove matrices from the bounded buffer
 int put(Matrix *value, void *args);
 Matrix * get(void*);
 void init_buffer_size_counter();
 
+// In-place ring slots.  A producer reserves a slot, generates into the
+// matrix it returns and commits it; a consumer gets it, reads it in
+// place and releases it.
+void init_slots(int held);
+void free_slots();
+Matrix * reserve_slot(int row, int col);
+void commit_slot(Matrix *value, void *args);
+void release_slot(Matrix *mat);
+
+// Byte budget for matrices in flight, see BOUNDED_BUFFER_BYTES
+void reserve_bytes(long bytes);
+void release_bytes(long bytes);
+void adjust_bytes(long delta);
+int get_buffer_depth();
+long get_inflight_bytes();
+long get_peak_bytes();
+
+// Remote workers; the run is aborted if the last one loses its consumer,
+// and failed if any of them does
+void init_remote_workers(int n);
+int get_run_aborted();
+int get_remote_failed(long *lost);
+
 
 #endif //PROCON_PROCON_H
\ No newline at end of file
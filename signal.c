@@ -1,16 +1,41 @@
 /*
- *  Signal example
+ *  Signal example / handoff benchmark
  *  Based on Operating Systems: Three Easy Pieces by R. Arpaci-Dusseau and A. Arpaci-Dusseau
  *
- *  This example uses locks and a condition to synchronize a child thread and
- *  the parent.  The child generates matricies and the parent computes the
- *  average when the matrix is ready for processing.
+ *  Started life as a one-slot producer/consumer using a lock, a condition
+ *  and a ready flag.  It now measures the cost of handing work from one
+ *  thread to another with each of the wait primitives we could use for the
+ *  bounded buffer:
+ *
+ *    condvar   - pthread mutex + condition variable + count
+ *    semaphore - POSIX sem_t
+ *    futex     - atomic count, FUTEX_WAIT / FUTEX_WAKE when it hits zero
+ *    eventfd   - eventfd in EFD_SEMAPHORE mode
+ *    pipe      - one byte per token through a pipe
+ *    spin      - spin on an atomic count (yields every SPIN_YIELD tries so
+ *                the same-core case still makes progress)
+ *
+ *  Two patterns are timed for each primitive:
+ *
+ *    pingpong  - one item in flight, producer waits for the consumer's reply
+ *                before sending the next one.  Reports one-way latency.
+ *    stream    - producer fills a STREAM_DEPTH slot ring, consumer drains it.
+ *                Reports per-item cost and throughput.
+ *
+ *  and each pattern is run with both threads pinned to the same core and
+ *  to two different cores (skipped if only one cpu is available).
+ *
+ *  usage: handoff_bench [iterations] [primitive]
  *
  *  University of Washington, Tacoma
  *  TCSS 422 - Operating Systems
  *  Spring 2019
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -18,132 +43,350 @@
 #include <unistd.h>
 #include <sched.h>
 #include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
-//#define NUMTHREADS 8
 #define OUTPUT 0
 #define MATRICIES 100000
 
-int **bigmatrix;
-int r = 5;
-int c = 5;
+// Depth of the ring used by the stream pattern
+#define STREAM_DEPTH 64
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-int ready = 0;
+// Number of failed spins before the spin primitive yields the cpu
+#define SPIN_YIELD 1024
 
-int **AllocMatrix(int r, int c) {
-  int **a;
-  int i;
-  a = (int **) malloc(sizeof(int *) * r);
-  assert(a != 0);
-  for (i = 0; i < r; i++) {
-    a[i] = (int *) malloc(c * sizeof(int));
-    assert(a[i] != 0);
+// HANDOFF PRIMITIVES
+// Each primitive is a counting channel: post() adds a token, wait() blocks
+// until a token is available and takes it.  A channel has exactly one
+// waiting thread, which the futex and spin versions rely on.
+typedef enum {
+  PRIM_CONDVAR,
+  PRIM_SEMAPHORE,
+  PRIM_FUTEX,
+  PRIM_EVENTFD,
+  PRIM_PIPE,
+  PRIM_SPIN,
+  PRIM_COUNT
+} prim_t;
+
+static const char *prim_names[PRIM_COUNT] = {
+  "condvar", "semaphore", "futex", "eventfd", "pipe", "spin"
+};
+
+typedef struct channel {
+  prim_t prim;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int count;
+  sem_t sem;
+  atomic_int acount;
+  int fd[2];
+} channel_t;
+
+// read()/write() exactly n bytes or die; kept out of assert() so NDEBUG
+// builds still move the tokens
+static void xwrite(int fd, const void *buf, size_t n) {
+  if (write(fd, buf, n) != (ssize_t) n) {
+    perror("write");
+    exit(1);
   }
-  return a;
 }
 
-void FreeMatrix(int **a, int r, int c) {
+static void xread(int fd, void *buf, size_t n) {
+  if (read(fd, buf, n) != (ssize_t) n) {
+    perror("read");
+    exit(1);
+  }
+}
+
+static void chan_init(channel_t *ch, prim_t prim, int tokens) {
   int i;
-  for (i = 0; i < r; i++) {
-    free(a[i]);
+  memset(ch, 0, sizeof(channel_t));
+  ch->prim = prim;
+  switch (prim) {
+    case PRIM_CONDVAR:
+      pthread_mutex_init(&ch->lock, NULL);
+      pthread_cond_init(&ch->cond, NULL);
+      ch->count = tokens;
+      break;
+    case PRIM_SEMAPHORE:
+      sem_init(&ch->sem, 0, tokens);
+      break;
+    case PRIM_FUTEX:
+    case PRIM_SPIN:
+      atomic_init(&ch->acount, tokens);
+      break;
+    case PRIM_EVENTFD:
+      ch->fd[0] = eventfd(tokens, EFD_SEMAPHORE);
+      if (ch->fd[0] < 0) {
+        perror("eventfd");
+        exit(1);
+      }
+      break;
+    case PRIM_PIPE:
+      if (pipe(ch->fd) != 0) {
+        perror("pipe");
+        exit(1);
+      }
+      for (i = 0; i < tokens; i++) {
+        char b = 0;
+        xwrite(ch->fd[1], &b, 1);
+      }
+      break;
+    default:
+      assert(0);
   }
-  free(a);
 }
 
-void GenMatrix(int **matrix, const int height, const int width) {
-  int i, j;
-  for (i = 0; i < height; i++) {
-    for (j = 0; j < width; j++) {
-      int *mm = matrix[i];
-      //matrix[i * width + j] = rand() % 10;
-      //mm[j] = rand() % 1000;
-      mm[j] = 1;
-#if OUTPUT
-      printf("matrix[%d][%d]=%d \n",i,j,mm[j]);
-#endif
-    }
+static void chan_destroy(channel_t *ch) {
+  switch (ch->prim) {
+    case PRIM_CONDVAR:
+      pthread_mutex_destroy(&ch->lock);
+      pthread_cond_destroy(&ch->cond);
+      break;
+    case PRIM_SEMAPHORE:
+      sem_destroy(&ch->sem);
+      break;
+    case PRIM_EVENTFD:
+      close(ch->fd[0]);
+      break;
+    case PRIM_PIPE:
+      close(ch->fd[0]);
+      close(ch->fd[1]);
+      break;
+    default:
+      break;
   }
 }
 
-int AvgElement(int **matrix, const int height, const int width) {
-  int x = 0;
-  int y = 0;
-  int ele = 0;
-  int i, j;
-  for (i = 0; i < height; i++)
-    for (j = 0; j < width; j++) {
-      int *mm = matrix[i];
-      y = mm[j];
-      x = x + y;
-      ele++;
-#if OUTPUT
-      printf("[%d][%d]--%d x=%d ele=%d\n",i,j,mm[j],x,ele);
-#endif
-    }
-#if OUTPUT
-  printf("AVG ELEMENT matrix-total-sum=%d element-count=%d avg-elem=%d\n",x, ele, x / ele);
-#endif
-  //printf("AVG ELEMENT matrix-total-sum=%d element-count=%d avg-elem=%d\n",x, ele, x / ele);
-  return x / ele;
+static long futex(atomic_int *addr, int op, int val) {
+  return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+static void chan_post(channel_t *ch) {
+  uint64_t one = 1;
+  char b = 0;
+  switch (ch->prim) {
+    case PRIM_CONDVAR:
+      pthread_mutex_lock(&ch->lock);
+      ch->count++;
+      pthread_cond_signal(&ch->cond);
+      pthread_mutex_unlock(&ch->lock);
+      break;
+    case PRIM_SEMAPHORE:
+      sem_post(&ch->sem);
+      break;
+    case PRIM_FUTEX:
+      // Only a transition from zero can have a sleeper behind it
+      if (atomic_fetch_add(&ch->acount, 1) == 0)
+        futex(&ch->acount, FUTEX_WAKE_PRIVATE, 1);
+      break;
+    case PRIM_EVENTFD:
+      xwrite(ch->fd[0], &one, sizeof(one));
+      break;
+    case PRIM_PIPE:
+      xwrite(ch->fd[1], &b, 1);
+      break;
+    case PRIM_SPIN:
+      atomic_fetch_add(&ch->acount, 1);
+      break;
+    default:
+      assert(0);
+  }
+}
+
+static void chan_wait(channel_t *ch) {
+  uint64_t val;
+  char b;
+  int spins = 0;
+  switch (ch->prim) {
+    case PRIM_CONDVAR:
+      pthread_mutex_lock(&ch->lock);
+      while (ch->count == 0)
+        pthread_cond_wait(&ch->cond, &ch->lock);
+      ch->count--;
+      pthread_mutex_unlock(&ch->lock);
+      break;
+    case PRIM_SEMAPHORE:
+      while (sem_wait(&ch->sem) != 0)
+        ;
+      break;
+    case PRIM_FUTEX:
+      // FUTEX_WAIT returns at once if the count is no longer zero
+      while (atomic_load(&ch->acount) == 0)
+        futex(&ch->acount, FUTEX_WAIT_PRIVATE, 0);
+      atomic_fetch_sub(&ch->acount, 1);
+      break;
+    case PRIM_EVENTFD:
+      xread(ch->fd[0], &val, sizeof(val));
+      break;
+    case PRIM_PIPE:
+      xread(ch->fd[0], &b, 1);
+      break;
+    case PRIM_SPIN:
+      while (atomic_load_explicit(&ch->acount, memory_order_acquire) == 0) {
+        if (++spins == SPIN_YIELD) {
+          sched_yield();
+          spins = 0;
+        }
+      }
+      atomic_fetch_sub(&ch->acount, 1);
+      break;
+    default:
+      assert(0);
+  }
+}
+
+// BENCHMARK
+typedef enum { PAT_PINGPONG, PAT_STREAM } pattern_t;
+
+typedef struct bench {
+  pattern_t pattern;
+  int loops;
+  int cpu[2];
+  channel_t items;    // producer -> consumer
+  channel_t slots;    // consumer -> producer
+  long ring[STREAM_DEPTH];
+  long sum;
+  pthread_barrier_t start;
+} bench_t;
+
+static void pin_self(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+}
+
+void *producer(void *arg)   // ITEM PRODUCER
+{
+  bench_t *b = (bench_t *) arg;
+  int i;
+  pin_self(b->cpu[0]);
+  pthread_barrier_wait(&b->start);
+  for (i = 0; i < b->loops; i++) {
+    chan_wait(&b->slots);
+    b->ring[i % STREAM_DEPTH] = i;
+    chan_post(&b->items);
+  }
+  return NULL;
 }
 
-void *worker(void *arg)   // MATRIX PRODUCER
+void *consumer(void *arg)   // ITEM CONSUMER
 {
-  int *loops = (int *) &arg;
+  bench_t *b = (bench_t *) arg;
+  long sum = 0;
+  int i;
+  pin_self(b->cpu[1]);
+  pthread_barrier_wait(&b->start);
+  for (i = 0; i < b->loops; i++) {
+    chan_wait(&b->items);
+    sum += b->ring[i % STREAM_DEPTH];
 #if OUTPUT
-  printf("In worker...\n");
-  printf("loops=%d\n",*loops);
+    printf("item #%d: %ld\n", i, b->ring[i % STREAM_DEPTH]);
 #endif
-  int i;
-  int **bm;
-  for (i = 0; i < *loops; i++) {
-    bm = AllocMatrix(r, c);
-    GenMatrix(bm, r, c);
-
-    pthread_mutex_lock(&mutex);
-    bigmatrix = bm;
-    // signal parent
-    ready = 1;
-
-    pthread_cond_signal(&cond);
-    while (ready == 1)
-      pthread_cond_wait(&cond, &mutex);
-    pthread_mutex_unlock(&mutex);
+    chan_post(&b->slots);
   }
+  b->sum = sum;
   return NULL;
 }
 
-int main(int argc, char *argv[]) {
-  pthread_t p1;
-  printf("main: begin \n");
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run one primitive/pattern/placement and print a result row
+static void run_bench(prim_t prim, pattern_t pattern, int cpu0, int cpu1, int loops) {
+  pthread_t p1, p2;
+  bench_t *b = (bench_t *) malloc(sizeof(bench_t));
+  assert(b != 0);
+  memset(b, 0, sizeof(bench_t));
+  b->pattern = pattern;
+  b->loops = loops;
+  b->cpu[0] = cpu0;
+  b->cpu[1] = cpu1;
+  // Ping-pong is a ring of depth one: the slot token is the reply
+  chan_init(&b->items, prim, 0);
+  chan_init(&b->slots, prim, pattern == PAT_PINGPONG ? 1 : STREAM_DEPTH);
+  pthread_barrier_init(&b->start, NULL, 3);
+
+  pthread_create(&p1, NULL, producer, b);
+  pthread_create(&p2, NULL, consumer, b);
+  pthread_barrier_wait(&b->start);
+  double t0 = now_sec();
+  pthread_join(p1, NULL);
+  pthread_join(p2, NULL);
+  double elapsed = now_sec() - t0;
 
+  long expect = (long) loops * (loops - 1) / 2;
+  if (b->sum != expect)
+    fprintf(stderr, "%s: lost items! sum=%ld expected=%ld\n", prim_names[prim], b->sum, expect);
+
+  // A ping-pong round trip is two handoffs
+  double handoffs = pattern == PAT_PINGPONG ? 2.0 * loops : (double) loops;
+  printf("%-10s %-9s %-6s %10d %12.1f %14.0f\n",
+         prim_names[prim], pattern == PAT_PINGPONG ? "pingpong" : "stream",
+         cpu0 == cpu1 ? "same" : "cross", loops,
+         elapsed * 1e9 / handoffs, loops / elapsed);
+
+  pthread_barrier_destroy(&b->start);
+  chan_destroy(&b->items);
+  chan_destroy(&b->slots);
+  free(b);
+}
+
+int main(int argc, char *argv[]) {
   int loops = MATRICIES;
-  int i;
+  int only = -1;
+  int cpus[2];
+  int ncpu = 0;
+  int i, m;
+  cpu_set_t set;
 
-  pthread_create(&p1, NULL, worker, loops);  // CREATE MATRIX PRODUCER THREAD
-
-  // Consume matrices produced...  CONSUME THE MATRIX
-  for (i = 0; i < loops; i++) {
-    pthread_mutex_lock(&mutex);
-    while (ready == 0)
-      pthread_cond_wait(&cond, &mutex);
-    int **bm = *&bigmatrix;
-    ready = 0;
-    pthread_cond_signal(&cond);
-    pthread_mutex_unlock(&mutex);
-
-    int avgele = AvgElement(bm, r, c);
-    printf("Matrix #%d: avg element value=%d\n", i, avgele);
-    FreeMatrix(bm, r, c);
-
-    ready = 0;
-    pthread_cond_signal(&cond);
-    pthread_mutex_unlock(&mutex);
+  if (argc > 1)
+    loops = atoi(argv[1]);
+  if (argc > 2) {
+    for (i = 0; i < PRIM_COUNT; i++)
+      if (strcmp(argv[2], prim_names[i]) == 0)
+        only = i;
+    if (only < 0) {
+      fprintf(stderr, "unknown primitive '%s'\n", argv[2]);
+      return 1;
+    }
+  }
+  if (loops <= 0) {
+    fprintf(stderr, "usage: %s [iterations] [primitive]\n", argv[0]);
+    return 1;
   }
 
-  pthread_join(p1, NULL);
-  return 0;
-}
+  // Pick the first two cpus this process may run on
+  sched_getaffinity(0, sizeof(cpu_set_t), &set);
+  for (i = 0; i < CPU_SETSIZE && ncpu < 2; i++)
+    if (CPU_ISSET(i, &set))
+      cpus[ncpu++] = i;
 
+  printf("handoff_bench: iterations=%d stream_depth=%d cpus=%d", loops, STREAM_DEPTH, cpus[0]);
+  if (ncpu > 1)
+    printf(",%d", cpus[1]);
+  printf("\n");
+  printf("%-10s %-9s %-6s %10s %12s %14s\n",
+         "primitive", "pattern", "cores", "items", "ns/handoff", "items/sec");
 
+  for (i = 0; i < PRIM_COUNT; i++) {
+    if (only >= 0 && only != i)
+      continue;
+    for (m = PAT_PINGPONG; m <= PAT_STREAM; m++) {
+      run_bench(i, m, cpus[0], cpus[0], loops);
+      if (ncpu > 1)
+        run_bench(i, m, cpus[0], cpus[1], loops);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,353 @@
+/*
+ *  Sparse matrix routines
+ *  Compressed sparse row (CSR) matrices and the kernels that multiply
+ *  them with dense and sparse operands
+ *
+ *  Generation walks each row with geometric skips between nonzeros, so
+ *  a matrix of density d costs O(rows + d*rows*cols) time and memory
+ *  instead of O(rows*cols).
+ *
+ *  University of Washington, Tacoma
+ *  TCSS 422 - Operating Systems
+ *  Spring 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include "matrix.h"
+#include "sparse.h"
+
+// Grow the nonzero arrays to hold at least need entries
+static void csr_reserve(Matrix * mat, long need)
+{
+  if (need <= mat->csr.cap)
+    return;
+  long cap = mat->csr.cap * 2;
+  if (cap < need)
+    cap = need;
+  mat->csr.colidx = (int *) realloc(mat->csr.colidx, cap * sizeof(int));
+  mat->csr.vals = realloc(mat->csr.vals, cap * ElemSize(mat->type));
+  assert(mat->csr.colidx != 0 && mat->csr.vals != 0);
+  mat->csr.cap = cap;
+}
+
+static int cmp_int(const void * a, const void * b)
+{
+  int x = *(const int *) a;
+  int y = *(const int *) b;
+  return (x > y) - (x < y);
+}
+
+// TYPED KERNELS
+// SPARSE_KERNELS(NAME, T, ACC) defines for element type T:
+//   fill_sparse_NAME - set every stored value to 1..10
+//   spmm_NAME        - dense c = csr a * dense b; the inner loop walks a
+//                      contiguous row of b so it vectorizes
+//   dsmm_NAME        - dense c = dense a * csr b
+//   spgemm_NAME      - csr c = csr a * csr b, Gustavson's row-by-row
+//                      method with a dense accumulator for one row of c
+//   sum_sparse_NAME  - sum of the stored values, accumulated in ACC
+#define SPARSE_KERNELS(NAME, T, ACC)                                    \
+static void fill_sparse_##NAME(Matrix * mat)                            \
+{                                                                       \
+  T * v = (T *) mat->csr.vals;                                          \
+  long p;                                                               \
+  for (p = 0; p < mat->csr.nnz; p++)                                    \
+    v[p] = (T) (1 + rand() % 10);                                       \
+}                                                                       \
+                                                                        \
+static void spmm_##NAME(Matrix * a, Matrix * b, Matrix * c)             \
+{                                                                       \
+  const T * av = (const T *) a->csr.vals;                               \
+  int n = b->cols;                                                      \
+  int i, j, p;                                                          \
+  for (i = 0; i < a->rows; i++)                                         \
+  {                                                                     \
+    T * restrict cr = (T *) c->rowp[i];                                 \
+    for (j = 0; j < n; j++)                                             \
+      cr[j] = 0;                                                        \
+    for (p = a->csr.rowptr[i]; p < a->csr.rowptr[i + 1]; p++)           \
+    {                                                                   \
+      const T aik = av[p];                                              \
+      const T * restrict br = (const T *) b->rowp[a->csr.colidx[p]];    \
+      for (j = 0; j < n; j++)                                           \
+        cr[j] += aik * br[j];                                           \
+    }                                                                   \
+  }                                                                     \
+}                                                                       \
+                                                                        \
+static void dsmm_##NAME(Matrix * a, Matrix * b, Matrix * c)             \
+{                                                                       \
+  const T * bv = (const T *) b->csr.vals;                               \
+  int i, j, k, p;                                                       \
+  for (i = 0; i < a->rows; i++)                                         \
+  {                                                                     \
+    const T * ar = (const T *) a->rowp[i];                              \
+    T * cr = (T *) c->rowp[i];                                          \
+    for (j = 0; j < c->cols; j++)                                       \
+      cr[j] = 0;                                                        \
+    for (k = 0; k < a->cols; k++)                                       \
+    {                                                                   \
+      const T aik = ar[k];                                              \
+      if (aik == 0)                                                     \
+        continue;                                                       \
+      for (p = b->csr.rowptr[k]; p < b->csr.rowptr[k + 1]; p++)         \
+        cr[b->csr.colidx[p]] += aik * bv[p];                            \
+    }                                                                   \
+  }                                                                     \
+}                                                                       \
+                                                                        \
+static void spgemm_##NAME(Matrix * a, Matrix * b, Matrix * c)           \
+{                                                                       \
+  const T * av = (const T *) a->csr.vals;                               \
+  const T * bv = (const T *) b->csr.vals;                               \
+  T * acc = (T *) calloc(c->cols, sizeof(T));                           \
+  int * mark = (int *) malloc(c->cols * sizeof(int));                   \
+  int * touched = (int *) malloc(c->cols * sizeof(int));                \
+  int i, j, p, q, t;                                                    \
+  long nnz = 0;                                                         \
+  assert(acc != 0 && mark != 0 && touched != 0);                        \
+  for (j = 0; j < c->cols; j++)                                         \
+    mark[j] = -1;                                                       \
+  c->csr.rowptr[0] = 0;                                                 \
+  for (i = 0; i < a->rows; i++)                                         \
+  {                                                                     \
+    int ntouched = 0;                                                   \
+    for (p = a->csr.rowptr[i]; p < a->csr.rowptr[i + 1]; p++)           \
+    {                                                                   \
+      const T aik = av[p];                                              \
+      const int k = a->csr.colidx[p];                                   \
+      for (q = b->csr.rowptr[k]; q < b->csr.rowptr[k + 1]; q++)         \
+      {                                                                 \
+        j = b->csr.colidx[q];                                           \
+        if (mark[j] != i)                                               \
+        {                                                               \
+          mark[j] = i;                                                  \
+          acc[j] = 0;                                                   \
+          touched[ntouched++] = j;                                      \
+        }                                                               \
+        acc[j] += aik * bv[q];                                          \
+      }                                                                 \
+    }                                                                   \
+    qsort(touched, ntouched, sizeof(int), cmp_int);                     \
+    csr_reserve(c, nnz + ntouched);                                     \
+    for (t = 0; t < ntouched; t++)                                      \
+    {                                                                   \
+      c->csr.colidx[nnz] = touched[t];                                  \
+      ((T *) c->csr.vals)[nnz] = acc[touched[t]];                       \
+      nnz++;                                                            \
+    }                                                                   \
+    c->csr.rowptr[i + 1] = nnz;                                         \
+  }                                                                     \
+  c->csr.nnz = nnz;                                                     \
+  free(acc);                                                            \
+  free(mark);                                                           \
+  free(touched);                                                        \
+}                                                                       \
+                                                                        \
+static ACC sum_sparse_##NAME(Matrix * mat)                              \
+{                                                                       \
+  const T * v = (const T *) mat->csr.vals;                              \
+  ACC total = 0;                                                        \
+  long p;                                                               \
+  for (p = 0; p < mat->csr.nnz; p++)                                    \
+    total += v[p];                                                      \
+  return total;                                                         \
+}
+
+SPARSE_KERNELS(int32, int32_t, int64_t)
+SPARSE_KERNELS(int64, int64_t, int64_t)
+SPARSE_KERNELS(float, float, double)
+SPARSE_KERNELS(double, double, double)
+
+// SPARSE MATRIX ROUTINES
+Matrix * AllocSparse(int r, int c, ElemType type, long cap)
+{
+  Matrix * mat = (Matrix *) malloc(sizeof(Matrix));
+  assert(mat != 0);
+  if (cap < 1)
+    cap = 1;
+  mat->rows = r;
+  mat->cols = c;
+  mat->type = type;
+  mat->format = FMT_CSR;
+  mat->rowp = NULL;
+  mat->csr.nnz = 0;
+  mat->csr.cap = cap;
+  mat->csr.rowptr = (int *) calloc(r + 1, sizeof(int));
+  mat->csr.colidx = (int *) malloc(cap * sizeof(int));
+  mat->csr.vals = malloc(cap * ElemSize(type));
+  assert(mat->csr.rowptr != 0 && mat->csr.colidx != 0 && mat->csr.vals != 0);
+  return mat;
+}
+
+void FreeSparse(Matrix * mat)
+{
+  free(mat->csr.rowptr);
+  free(mat->csr.colidx);
+  free(mat->csr.vals);
+  free(mat);
+}
+
+// Each element is nonzero with probability density.  The gap to the
+// next nonzero in a row is geometric, so only nonzeros cost a rand().
+Matrix * GenSparseOfType(int row, int col, ElemType type, double density)
+{
+  long expect = (long) (density * row * col);
+  Matrix * mat = AllocSparse(row, col, type, expect + expect / 8 + row);
+  GenSparse(mat, density);
+  return mat;
+}
+
+// Regenerate the nonzeros of mat in its existing storage, growing the
+// arrays only if they are short.  rowptr must hold mat->rows + 1 entries.
+void GenSparse(Matrix * mat, double density)
+{
+  int row = mat->rows;
+  int col = mat->cols;
+  double logq = density < 1.0 ? log(1.0 - density) : 0.0;
+  long nnz = 0;
+  int i;
+  mat->csr.rowptr[0] = 0;
+  for (i = 0; i < row; i++)
+  {
+    long j = -1;
+    while (density > 0.0)
+    {
+      double gap = 0.0;
+      if (density < 1.0)
+        gap = log(1.0 - rand() / (RAND_MAX + 1.0)) / logq;
+      if (gap >= col)
+        break;
+      j += 1 + (long) gap;
+      if (j >= col)
+        break;
+      csr_reserve(mat, nnz + 1);
+      mat->csr.colidx[nnz++] = (int) j;
+    }
+    mat->csr.rowptr[i + 1] = nnz;
+  }
+  mat->csr.nnz = nnz;
+  switch (mat->type)
+  {
+    case ELEM_INT32:  fill_sparse_int32(mat);  break;
+    case ELEM_INT64:  fill_sparse_int64(mat);  break;
+    case ELEM_FLOAT:  fill_sparse_float(mat);  break;
+    case ELEM_DOUBLE: fill_sparse_double(mat); break;
+    default:          assert(0);
+  }
+}
+
+// Expected bytes of a generated row x col matrix of the given density,
+// used to charge the byte budget before the matrix exists
+long SparseBytes(int row, int col, ElemType type, double density)
+{
+  long expect = (long) (density * row * col);
+  return (row + 1) * (long) sizeof(int) + expect * (long) (sizeof(int) + ElemSize(type));
+}
+
+// Bytes actually held by a CSR matrix
+long SparseFootprint(Matrix * mat)
+{
+  return (mat->rows + 1) * (long) sizeof(int) +
+         mat->csr.cap * (long) (sizeof(int) + ElemSize(mat->type));
+}
+
+long long SumSparse(Matrix * mat)
+{
+  switch (mat->type)
+  {
+    case ELEM_INT32:  return sum_sparse_int32(mat);
+    case ELEM_INT64:  return sum_sparse_int64(mat);
+    case ELEM_FLOAT:  return (long long) sum_sparse_float(mat);
+    case ELEM_DOUBLE: return (long long) sum_sparse_double(mat);
+    default:          assert(0);
+  }
+  return 0;
+}
+
+double SumSparseReal(Matrix * mat)
+{
+  switch (mat->type)
+  {
+    case ELEM_INT32:  return (double) sum_sparse_int32(mat);
+    case ELEM_INT64:  return (double) sum_sparse_int64(mat);
+    case ELEM_FLOAT:  return sum_sparse_float(mat);
+    case ELEM_DOUBLE: return sum_sparse_double(mat);
+    default:          assert(0);
+  }
+  return 0;
+}
+
+// Print as a dense matrix with the zeros filled in
+void DisplaySparse(Matrix * mat, FILE *stream)
+{
+  int i, j, p;
+  for (i = 0; i < mat->rows; i++)
+  {
+    p = mat->csr.rowptr[i];
+    fprintf(stream, "|");
+    for (j = 0; j < mat->cols; j++)
+    {
+      int here = p < mat->csr.rowptr[i + 1] && mat->csr.colidx[p] == j;
+      if (j != 0)
+        fprintf(stream, " ");
+      switch (mat->type)
+      {
+        case ELEM_INT32:  fprintf(stream, "%3d", here ? ((int32_t *) mat->csr.vals)[p] : 0); break;
+        case ELEM_INT64:  fprintf(stream, "%3lld", here ? (long long) ((int64_t *) mat->csr.vals)[p] : 0LL); break;
+        case ELEM_FLOAT:  fprintf(stream, "%6.2f", here ? ((float *) mat->csr.vals)[p] : 0.0f); break;
+        case ELEM_DOUBLE: fprintf(stream, "%6.2f", here ? ((double *) mat->csr.vals)[p] : 0.0); break;
+        default:          assert(0);
+      }
+      if (here)
+        p++;
+    }
+    fprintf(stream, "|\n");
+  }
+}
+
+Matrix * SparseMultiplyDense(Matrix * a, Matrix * b)
+{
+  Matrix * c = AllocMatrixOfType(a->rows, b->cols, a->type);
+  switch (a->type)
+  {
+    case ELEM_INT32:  spmm_int32(a, b, c);  break;
+    case ELEM_INT64:  spmm_int64(a, b, c);  break;
+    case ELEM_FLOAT:  spmm_float(a, b, c);  break;
+    case ELEM_DOUBLE: spmm_double(a, b, c); break;
+    default:          assert(0);
+  }
+  return c;
+}
+
+Matrix * DenseMultiplySparse(Matrix * a, Matrix * b)
+{
+  Matrix * c = AllocMatrixOfType(a->rows, b->cols, a->type);
+  switch (a->type)
+  {
+    case ELEM_INT32:  dsmm_int32(a, b, c);  break;
+    case ELEM_INT64:  dsmm_int64(a, b, c);  break;
+    case ELEM_FLOAT:  dsmm_float(a, b, c);  break;
+    case ELEM_DOUBLE: dsmm_double(a, b, c); break;
+    default:          assert(0);
+  }
+  return c;
+}
+
+Matrix * SparseMultiplySparse(Matrix * a, Matrix * b)
+{
+  Matrix * c = AllocSparse(a->rows, b->cols, a->type, a->csr.nnz + b->csr.nnz);
+  switch (a->type)
+  {
+    case ELEM_INT32:  spgemm_int32(a, b, c);  break;
+    case ELEM_INT64:  spgemm_int64(a, b, c);  break;
+    case ELEM_FLOAT:  spgemm_float(a, b, c);  break;
+    case ELEM_DOUBLE: spgemm_double(a, b, c); break;
+    default:          assert(0);
+  }
+  return c;
+}
@@ -0,0 +1,35 @@
+/*
+ *  Sparse matrix header
+ *  Function prototypes, data, and constants for the CSR sparse matrix module
+ *
+ *  University of Washington, Tacoma
+ *  TCSS 422 - Operating Systems
+ *  Spring 2019
+ */
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include "matrix.h"
+
+// SPARSE MATRIX ROUTINES
+// Sparse matrices are Matrix structs with format FMT_CSR, so they go
+// through the bounded buffer, MatrixMultiply, SumMatrix and FreeMatrix
+// like dense ones.  Cost in memory and time follows the nonzero count.
+Matrix * AllocSparse(int r, int c, ElemType type, long cap);
+void FreeSparse(Matrix * mat);
+Matrix * GenSparseOfType(int row, int col, ElemType type, double density);
+void GenSparse(Matrix * mat, double density);
+long SparseBytes(int row, int col, ElemType type, double density);
+long SparseFootprint(Matrix * mat);
+long long SumSparse(Matrix * mat);
+double SumSparseReal(Matrix * mat);
+void DisplaySparse(Matrix * mat, FILE *stream);
+
+// Multiply kernels by operand format: CSR x dense (SpMM), dense x CSR,
+// and CSR x CSR (SpGEMM).  Operands must already be shape and type checked.
+Matrix * SparseMultiplyDense(Matrix * a, Matrix * b);
+Matrix * DenseMultiplySparse(Matrix * a, Matrix * b);
+Matrix * SparseMultiplySparse(Matrix * a, Matrix * b);
+
+#endif
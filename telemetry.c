@@ -0,0 +1,365 @@
+/*
+ *  telemetry module
+ *  Live throughput and queue depth sampling
+ *
+ *  A sampler thread wakes every interval and records the production,
+ *  consumption and multiply counters, the bounded buffer depth, the
+ *  matrix byte gauges, the state of every worker thread and the malloc
+ *  heap statistics.  Rates are averaged over the last TELEMETRY_WINDOW
+ *  samples.
+ *
+ *  The latest sample is served on a Unix domain socket in Prometheus text
+ *  format, to plain connections (socat - UNIX-CONNECT:path) and to HTTP
+ *  GETs (curl --unix-socket path http://localhost/metrics).  Each sample
+ *  can also be appended to a JSON lines file.
+ *
+ *  University of Washington, Tacoma
+ *  TCSS 422 - Operating Systems
+ *  Spring 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <malloc.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "counter.h"
+#include "matrix.h"
+#include "pcmatrix.h"
+#include "prodcons.h"
+#include "telemetry.h"
+
+static const char *state_names[STATE_COUNT] = {
+  "running", "wait_bytes", "wait_slot", "wait_fill", "wait_credit", "done"
+};
+
+// Worker thread registry
+typedef struct tracked_thread {
+  const char *role;
+  atomic_int state;
+} tracked_thread_t;
+
+static tracked_thread_t threads[TELEMETRY_MAX_THREADS];
+static atomic_int nthreads = 0;
+static __thread int my_slot = -1;
+
+// One sample of the run
+typedef struct sample {
+  double t;             // seconds since telemetry_start
+  int produced;
+  int consumed;
+  int multiplied;
+  int depth;
+  long inflight_bytes;
+  long peak_bytes;
+  long heap_arena;      // bytes malloc got from the system, main arena
+  long heap_in_use;     // bytes handed out by malloc
+  long heap_free;       // bytes free inside the arena
+  long heap_mmap;       // bytes in separately mmapped blocks
+} sample_t;
+
+static const thread_args_t *tparams;
+static sample_t window[TELEMETRY_WINDOW];
+static int nsamples = 0;
+static double start_time;
+static int interval_ms;
+static char *socket_path;
+static int listen_fd = -1;
+static FILE *jsonl;
+static int wake[2] = { -1, -1 };
+static pthread_t sampler;
+static int running = 0;
+
+void telemetry_register(const char *role) {
+  int slot = atomic_fetch_add(&nthreads, 1);
+  if (slot >= TELEMETRY_MAX_THREADS) {
+    atomic_store(&nthreads, TELEMETRY_MAX_THREADS);
+    return;
+  }
+  threads[slot].role = role;
+  atomic_store(&threads[slot].state, STATE_RUNNING);
+  my_slot = slot;
+}
+
+void telemetry_state(ThreadState state) {
+  if (my_slot >= 0)
+    atomic_store_explicit(&threads[my_slot].state, state, memory_order_relaxed);
+}
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void take_sample() {
+  sample_t *s = &window[nsamples % TELEMETRY_WINDOW];
+  s->t = now_sec() - start_time;
+  s->produced = get_cnt(tparams->counters->prod);
+  s->consumed = get_cnt(tparams->counters->cons);
+  s->multiplied = tparams->prodConStats->multtotal;
+  s->depth = get_buffer_depth();
+  s->inflight_bytes = get_inflight_bytes();
+  s->peak_bytes = get_peak_bytes();
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mi = mallinfo2();
+  s->heap_arena = mi.arena;
+  s->heap_in_use = mi.uordblks + mi.hblkhd;
+  s->heap_free = mi.fordblks;
+  s->heap_mmap = mi.hblkhd;
+#else
+  s->heap_arena = s->heap_in_use = s->heap_free = s->heap_mmap = -1;
+#endif
+  nsamples++;
+}
+
+// Per-second rate of a sample field over the window
+#define WINDOW_RATE(field) window_rate(offsetof(sample_t, field))
+static double window_rate(size_t offset) {
+  if (nsamples < 2)
+    return 0.0;
+  int span = nsamples < TELEMETRY_WINDOW ? nsamples - 1 : TELEMETRY_WINDOW - 1;
+  const sample_t *last = &window[(nsamples - 1) % TELEMETRY_WINDOW];
+  const sample_t *first = &window[(nsamples - 1 - span) % TELEMETRY_WINDOW];
+  double dt = last->t - first->t;
+  if (dt <= 0.0)
+    return 0.0;
+  int delta = *(const int *) ((const char *) last + offset) - *(const int *) ((const char *) first + offset);
+  return delta / dt;
+}
+
+static void prom_metric(FILE *stream, const char *name, const char *type, const char *help) {
+  fprintf(stream, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void render_prometheus(FILE *stream) {
+  const sample_t *s = &window[(nsamples - 1) % TELEMETRY_WINDOW];
+  int n = atomic_load(&nthreads);
+  int i;
+
+  prom_metric(stream, "pcmatrix_uptime_seconds", "gauge", "Seconds since the run started.");
+  fprintf(stream, "pcmatrix_uptime_seconds %.3f\n", s->t);
+  prom_metric(stream, "pcmatrix_matrices_produced_total", "counter", "Matrices put in the bounded buffer.");
+  fprintf(stream, "pcmatrix_matrices_produced_total %d\n", s->produced);
+  prom_metric(stream, "pcmatrix_matrices_consumed_total", "counter", "Matrices taken from the bounded buffer.");
+  fprintf(stream, "pcmatrix_matrices_consumed_total %d\n", s->consumed);
+  prom_metric(stream, "pcmatrix_multiplies_total", "counter", "Matrix multiplications completed.");
+  fprintf(stream, "pcmatrix_multiplies_total %d\n", s->multiplied);
+  prom_metric(stream, "pcmatrix_matrices_per_second", "gauge", "Rolling matrix rate.");
+  fprintf(stream, "pcmatrix_matrices_per_second{direction=\"produced\"} %.2f\n", WINDOW_RATE(produced));
+  fprintf(stream, "pcmatrix_matrices_per_second{direction=\"consumed\"} %.2f\n", WINDOW_RATE(consumed));
+  prom_metric(stream, "pcmatrix_multiplies_per_second", "gauge", "Rolling multiply rate.");
+  fprintf(stream, "pcmatrix_multiplies_per_second %.2f\n", WINDOW_RATE(multiplied));
+  prom_metric(stream, "pcmatrix_buffer_depth", "gauge", "Matrices waiting in the bounded buffer.");
+  fprintf(stream, "pcmatrix_buffer_depth %d\n", s->depth);
+  prom_metric(stream, "pcmatrix_buffer_slots", "gauge", "Capacity of the bounded buffer.");
+  fprintf(stream, "pcmatrix_buffer_slots %d\n", BOUNDED_BUFFER_SIZE);
+  prom_metric(stream, "pcmatrix_inflight_bytes", "gauge", "Bytes held by matrices produced but not yet freed.");
+  fprintf(stream, "pcmatrix_inflight_bytes %ld\n", s->inflight_bytes);
+  prom_metric(stream, "pcmatrix_inflight_bytes_peak", "gauge", "High water mark of pcmatrix_inflight_bytes.");
+  fprintf(stream, "pcmatrix_inflight_bytes_peak %ld\n", s->peak_bytes);
+  prom_metric(stream, "pcmatrix_heap_bytes", "gauge", "malloc heap statistics.");
+  fprintf(stream, "pcmatrix_heap_bytes{kind=\"arena\"} %ld\n", s->heap_arena);
+  fprintf(stream, "pcmatrix_heap_bytes{kind=\"in_use\"} %ld\n", s->heap_in_use);
+  fprintf(stream, "pcmatrix_heap_bytes{kind=\"free\"} %ld\n", s->heap_free);
+  fprintf(stream, "pcmatrix_heap_bytes{kind=\"mmap\"} %ld\n", s->heap_mmap);
+  prom_metric(stream, "pcmatrix_thread_state", "gauge", "1 for the state each worker thread is in.");
+  for (i = 0; i < n; i++) {
+    if (threads[i].role == NULL)
+      continue;
+    fprintf(stream, "pcmatrix_thread_state{thread=\"%d\",role=\"%s\",state=\"%s\"} 1\n",
+            i, threads[i].role, state_names[atomic_load(&threads[i].state)]);
+  }
+}
+
+static void render_json(FILE *stream) {
+  const sample_t *s = &window[(nsamples - 1) % TELEMETRY_WINDOW];
+  int n = atomic_load(&nthreads);
+  int i;
+  int emitted = 0;
+
+  fprintf(stream, "{\"time\":%ld,\"uptime\":%.3f,\"produced\":%d,\"consumed\":%d,\"multiplied\":%d,"
+                  "\"produced_per_sec\":%.2f,\"consumed_per_sec\":%.2f,\"multiplies_per_sec\":%.2f,"
+                  "\"buffer_depth\":%d,\"buffer_slots\":%d,\"inflight_bytes\":%ld,\"inflight_bytes_peak\":%ld,"
+                  "\"heap\":{\"arena\":%ld,\"in_use\":%ld,\"free\":%ld,\"mmap\":%ld},\"threads\":[",
+          (long) time(NULL), s->t, s->produced, s->consumed, s->multiplied,
+          WINDOW_RATE(produced), WINDOW_RATE(consumed), WINDOW_RATE(multiplied),
+          s->depth, BOUNDED_BUFFER_SIZE, s->inflight_bytes, s->peak_bytes,
+          s->heap_arena, s->heap_in_use, s->heap_free, s->heap_mmap);
+  for (i = 0; i < n; i++) {
+    if (threads[i].role == NULL)
+      continue;
+    // Separate from the last entry written, not from thread 0, which
+    // may still be registering and have been skipped
+    fprintf(stream, "%s{\"thread\":%d,\"role\":\"%s\",\"state\":\"%s\"}", emitted++ ? "," : "",
+            i, threads[i].role, state_names[atomic_load(&threads[i].state)]);
+  }
+  fprintf(stream, "]}\n");
+}
+
+static void send_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n <= 0)
+      return;
+    buf += n;
+    len -= n;
+  }
+}
+
+// Answer one connection with the latest sample.  Clients that send an
+// HTTP request within a moment get an HTTP response, anything else gets
+// the bare exposition text.
+static void serve_client(int fd) {
+  char req[512];
+  char *body = NULL;
+  size_t len = 0;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  int http = 0;
+
+  if (poll(&pfd, 1, 50) > 0) {
+    ssize_t n = recv(fd, req, sizeof(req) - 1, 0);
+    http = n >= 4 && strncmp(req, "GET ", 4) == 0;
+  }
+  FILE *stream = open_memstream(&body, &len);
+  if (stream == NULL)
+    return;
+  render_prometheus(stream);
+  fclose(stream);
+  if (http) {
+    char hdr[160];
+    int n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                       "Content-Length: %zu\r\n\r\n", len);
+    send_all(fd, hdr, n);
+  }
+  send_all(fd, body, len);
+  free(body);
+}
+
+static void publish() {
+  take_sample();
+  if (jsonl != NULL) {
+    render_json(jsonl);
+    fflush(jsonl);
+  }
+}
+
+// Sampler thread: sample on schedule, serve socket clients in between,
+// leave when telemetry_stop writes to the wake pipe
+static void *sampler_worker(void *arg) {
+  double next = now_sec() + interval_ms / 1000.0;
+  struct pollfd pfd[2];
+
+  for (;;) {
+    int timeout = (int) ((next - now_sec()) * 1000.0);
+    if (timeout < 0)
+      timeout = 0;
+    pfd[0].fd = wake[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = listen_fd;
+    pfd[1].events = POLLIN;
+    int rc = poll(pfd, listen_fd >= 0 ? 2 : 1, timeout);
+    if (rc > 0 && (pfd[0].revents & POLLIN))
+      break;
+    if (rc > 0 && listen_fd >= 0 && (pfd[1].revents & POLLIN)) {
+      int fd = accept(listen_fd, NULL, NULL);
+      if (fd >= 0) {
+        serve_client(fd);
+        close(fd);
+      }
+    }
+    if (now_sec() >= next) {
+      publish();
+      next += interval_ms / 1000.0;
+    }
+  }
+  return NULL;
+}
+
+static int open_socket(const char *path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    printf("Telemetry socket path too long: %s\n", path);
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("telemetry socket");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 8) != 0) {
+    perror("telemetry bind");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void telemetry_start(const struct thread_args *params) {
+  char *sock = getenv(TELEMETRY_SOCKET_ENV);
+  char *path = getenv(TELEMETRY_JSONL_ENV);
+  char *interval = getenv(TELEMETRY_INTERVAL_ENV);
+
+  if ((sock == NULL || *sock == 0) && (path == NULL || *path == 0))
+    return;
+  tparams = params;
+  interval_ms = DEFAULT_TELEMETRY_INTERVAL_MS;
+  if (interval != NULL && atoi(interval) > 0)
+    interval_ms = atoi(interval);
+  start_time = now_sec();
+
+  if (sock != NULL && *sock != 0) {
+    listen_fd = open_socket(sock);
+    if (listen_fd >= 0)
+      socket_path = sock;
+  }
+  if (path != NULL && *path != 0) {
+    jsonl = fopen(path, "a");
+    if (jsonl == NULL)
+      perror("telemetry jsonl");
+  }
+  if (listen_fd < 0 && jsonl == NULL)
+    return;
+  if (pipe(wake) != 0) {
+    perror("telemetry pipe");
+    return;
+  }
+
+  // Serve a zero sample until the first interval passes
+  publish();
+  printf("Telemetry every %d ms%s%s%s%s\n", interval_ms,
+         socket_path ? " on " : "", socket_path ? socket_path : "",
+         jsonl ? " to " : "", jsonl ? path : "");
+  pthread_create(&sampler, NULL, sampler_worker, NULL);
+  running = 1;
+}
+
+void telemetry_stop() {
+  if (!running)
+    return;
+  char b = 0;
+  if (write(wake[1], &b, 1) != 1)
+    perror("telemetry wake");
+  pthread_join(sampler, NULL);
+  running = 0;
+  publish();
+  if (jsonl != NULL)
+    fclose(jsonl);
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    unlink(socket_path);
+  }
+  close(wake[0]);
+  close(wake[1]);
+}
@@ -0,0 +1,54 @@
+/*
+ *  telemetry header
+ *  Function prototypes, data, and constants for the live telemetry module
+ *
+ *  University of Washington, Tacoma
+ *  TCSS 422 - Operating Systems
+ *  Spring 2019
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+// Environment variables that switch telemetry on.  Either output enables
+// the sampler thread.
+//   PCMATRIX_METRICS_SOCKET      - Unix socket path serving the latest
+//                                  sample in Prometheus text format
+//   PCMATRIX_METRICS_JSONL       - file each sample is appended to as
+//                                  one JSON line
+//   PCMATRIX_METRICS_INTERVAL_MS - sample interval, default below
+#define TELEMETRY_SOCKET_ENV "PCMATRIX_METRICS_SOCKET"
+#define TELEMETRY_JSONL_ENV "PCMATRIX_METRICS_JSONL"
+#define TELEMETRY_INTERVAL_ENV "PCMATRIX_METRICS_INTERVAL_MS"
+#define DEFAULT_TELEMETRY_INTERVAL_MS 1000
+
+// Rates are averaged over this many samples
+#define TELEMETRY_WINDOW 5
+
+// Most worker threads whose state is tracked
+#define TELEMETRY_MAX_THREADS 64
+
+// What a worker thread is doing right now
+typedef enum thread_state {
+  STATE_RUNNING,        // generating or multiplying
+  STATE_WAIT_BYTES,     // producer blocked on BOUNDED_BUFFER_BYTES
+  STATE_WAIT_SLOT,      // producer blocked on a full buffer
+  STATE_WAIT_FILL,      // consumer blocked on an empty buffer
+  STATE_WAIT_CREDIT,    // remote worker blocked on pcConsumer credits
+  STATE_DONE,
+  STATE_COUNT
+} ThreadState;
+
+struct thread_args;
+
+// Start and stop the sampler thread.  Start does nothing unless one of
+// the environment variables above is set; stop takes a final sample.
+void telemetry_start(const struct thread_args *params);
+void telemetry_stop();
+
+// Worker threads register once, then report state changes.  Both are
+// cheap no-ops for threads that never registered.
+void telemetry_register(const char *role);
+void telemetry_state(ThreadState state);
+
+#endif
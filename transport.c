@@ -0,0 +1,322 @@
+/*
+ *  transport module
+ *  Socket transport between pcMatrix and remote pcConsumer processes
+ *
+ *  Carries the frames described in transport.h over a Unix domain or TCP
+ *  stream socket, and packs matrices of either format into them.  The
+ *  worker logic on both ends lives in prodcons.c and pcconsumer.c.
+ *
+ *  University of Washington, Tacoma
+ *  TCSS 422 - Operating Systems
+ *  Spring 2019
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "matrix.h"
+#include "sparse.h"
+#include "transport.h"
+
+// On-wire header in front of each packed matrix
+typedef struct packed_hdr {
+  int32_t rows;
+  int32_t cols;
+  int32_t type;
+  int32_t format;
+  int64_t nnz;
+} packed_hdr_t;
+
+// Open a socket for address, bound and listening if listening is set,
+// connected otherwise.  Returns the fd or -1.
+static int open_address(const char *address, int listening) {
+  int fd = -1;
+
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un addr;
+    const char *path = address + 5;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      printf("Socket path too long: %s\n", path);
+      return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+      return -1;
+    if (listening) {
+      unlink(path);
+      if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 && listen(fd, 16) == 0)
+        return fd;
+    } else if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+      return fd;
+    }
+    close(fd);
+    return -1;
+  }
+
+  if (strncmp(address, "tcp:", 4) == 0) {
+    char host[256];
+    const char *port = strrchr(address + 4, ':');
+    struct addrinfo hints, *res, *ai;
+    int one = 1;
+    if (port == NULL || (size_t) (port - (address + 4)) >= sizeof(host)) {
+      printf("Bad tcp address %s, use tcp:host:port\n", address);
+      return -1;
+    }
+    memcpy(host, address + 4, port - (address + 4));
+    host[port - (address + 4)] = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    if (getaddrinfo(host[0] ? host : NULL, port + 1, &hints, &res) != 0)
+      return -1;
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+      fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (fd < 0)
+        continue;
+      if (listening) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 16) == 0)
+          break;
+      } else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+        // Frames are written whole; don't let Nagle hold back credits
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        break;
+      }
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+  }
+
+  printf("Unknown transport address %s, use unix:path or tcp:host:port\n", address);
+  return -1;
+}
+
+int transport_listen(const char *address) {
+  int fd = open_address(address, 1);
+  if (fd < 0)
+    perror("transport listen");
+  return fd;
+}
+
+// Stop listening, removing the socket file of a unix: address
+void transport_unlisten(int listen_fd, const char *address) {
+  close(listen_fd);
+  if (strncmp(address, "unix:", 5) == 0)
+    unlink(address + 5);
+}
+
+int transport_accept(int listen_fd) {
+  int one = 1;
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd >= 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+// Retry for TRANSPORT_CONNECT_WAIT seconds so consumers can be started
+// before pcMatrix is listening
+int transport_connect(const char *address) {
+  int tries;
+  for (tries = 0; tries < TRANSPORT_CONNECT_WAIT * 10; tries++) {
+    int fd = open_address(address, 0);
+    if (fd >= 0)
+      return fd;
+    usleep(100000);
+  }
+  perror("transport connect");
+  return -1;
+}
+
+int transport_readable(int fd, int timeout_ms) {
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+  const char *p = (const char *) buf;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+  char *p = (char *) buf;
+  while (len > 0) {
+    ssize_t n = recv(fd, p, len, 0);
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int frame_buf_reserve(frame_buf_t *buf, size_t cap) {
+  if (cap <= buf->cap)
+    return 0;
+  if (cap < buf->cap * 2)
+    cap = buf->cap * 2;
+  char *data = (char *) realloc(buf->data, cap);
+  if (data == NULL)
+    return -1;
+  buf->data = data;
+  buf->cap = cap;
+  return 0;
+}
+
+int frame_buf_append(frame_buf_t *buf, const void *data, size_t len) {
+  if (frame_buf_reserve(buf, buf->len + len) != 0)
+    return -1;
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  return 0;
+}
+
+void frame_buf_free(frame_buf_t *buf) {
+  free(buf->data);
+  buf->data = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+}
+
+int send_frame(int fd, FrameType type, const void *payload, size_t len) {
+  frame_hdr_t hdr = { TRANSPORT_MAGIC, type, len };
+  if (write_full(fd, &hdr, sizeof(hdr)) != 0)
+    return -1;
+  return len > 0 ? write_full(fd, payload, len) : 0;
+}
+
+int recv_frame(int fd, frame_buf_t *buf, FrameType *type) {
+  frame_hdr_t hdr;
+  if (read_full(fd, &hdr, sizeof(hdr)) != 0)
+    return -1;
+  if (hdr.magic != TRANSPORT_MAGIC) {
+    printf("transport: bad frame magic %x\n", hdr.magic);
+    return -1;
+  }
+  if (hdr.len > TRANSPORT_MAX_FRAME) {
+    printf("transport: frame of %llu bytes is over the limit\n", (unsigned long long) hdr.len);
+    return -1;
+  }
+  if (frame_buf_reserve(buf, hdr.len) != 0)
+    return -1;
+  buf->len = hdr.len;
+  *type = (FrameType) hdr.type;
+  return hdr.len > 0 ? read_full(fd, buf->data, hdr.len) : 0;
+}
+
+// MATRIX PACKING
+// packed_hdr_t, then for dense matrices the rows*cols elements, for CSR
+// rowptr, colidx and the nnz values
+int PackMatrix(Matrix *mat, frame_buf_t *buf) {
+  size_t esize = ElemSize(mat->type);
+  packed_hdr_t hdr = { mat->rows, mat->cols, mat->type, mat->format, 0 };
+  // Grow once for the whole matrix, so the appends below can't fail
+  if (frame_buf_reserve(buf, buf->len + PackedBytes(mat)) != 0)
+    return -1;
+  if (mat->format == FMT_CSR) {
+    hdr.nnz = mat->csr.nnz;
+    frame_buf_append(buf, &hdr, sizeof(hdr));
+    frame_buf_append(buf, mat->csr.rowptr, (mat->rows + 1) * sizeof(int));
+    frame_buf_append(buf, mat->csr.colidx, mat->csr.nnz * sizeof(int));
+    frame_buf_append(buf, mat->csr.vals, mat->csr.nnz * esize);
+  } else {
+    frame_buf_append(buf, &hdr, sizeof(hdr));
+    frame_buf_append(buf, mat->rowp[0], (size_t) mat->rows * mat->cols * esize);
+  }
+  return 0;
+}
+
+// Bytes PackMatrix adds for mat
+size_t PackedBytes(Matrix *mat) {
+  size_t esize = ElemSize(mat->type);
+  if (mat->format == FMT_CSR)
+    return sizeof(packed_hdr_t) + (mat->rows + 1) * sizeof(int) + mat->csr.nnz * (sizeof(int) + esize);
+  return sizeof(packed_hdr_t) + (size_t) mat->rows * mat->cols * esize;
+}
+
+// The kernels index by rowptr and colidx without checks, so a CSR
+// matrix from the wire must have rows that start at 0, never go
+// backwards and end at nnz, with columns ascending within each row
+// and inside the matrix
+static int valid_csr(const int *rowptr, const int *colidx, int rows, int cols, long nnz) {
+  int i;
+  long j;
+  if (rowptr[0] != 0 || rowptr[rows] != nnz)
+    return 0;
+  for (i = 0; i < rows; i++) {
+    if (rowptr[i + 1] < rowptr[i])
+      return 0;
+    for (j = rowptr[i]; j < rowptr[i + 1]; j++) {
+      if (colidx[j] < 0 || colidx[j] >= cols)
+        return 0;
+      if (j > rowptr[i] && colidx[j] <= colidx[j - 1])
+        return 0;
+    }
+  }
+  return 1;
+}
+
+// Unpack the matrix at *src and advance *src past it; NULL if the bytes
+// up to end don't hold a whole, well formed matrix.  Every size is
+// checked against the bytes left before it is multiplied out, so a bad
+// header can't overflow them.
+Matrix *UnpackMatrix(const char **src, const char *end) {
+  packed_hdr_t hdr;
+  const char *p = *src;
+  Matrix *mat;
+
+  if (end - p < (long) sizeof(hdr))
+    return NULL;
+  memcpy(&hdr, p, sizeof(hdr));
+  p += sizeof(hdr);
+  if (hdr.rows <= 0 || hdr.cols <= 0 || hdr.type < 0 || hdr.type >= ELEM_TYPE_COUNT)
+    return NULL;
+  if (hdr.format != FMT_DENSE && hdr.format != FMT_CSR)
+    return NULL;
+  size_t esize = ElemSize(hdr.type);
+  size_t left = end - p;
+
+  if (hdr.format == FMT_CSR) {
+    size_t rowbytes = ((size_t) hdr.rows + 1) * sizeof(int);
+    if (rowbytes > left || hdr.nnz < 0 || (size_t) hdr.nnz > (left - rowbytes) / (sizeof(int) + esize))
+      return NULL;
+    if (!valid_csr((const int *) p, (const int *) (p + rowbytes), hdr.rows, hdr.cols, hdr.nnz))
+      return NULL;
+    mat = AllocSparse(hdr.rows, hdr.cols, hdr.type, hdr.nnz);
+    memcpy(mat->csr.rowptr, p, rowbytes);
+    p += rowbytes;
+    memcpy(mat->csr.colidx, p, hdr.nnz * sizeof(int));
+    p += hdr.nnz * sizeof(int);
+    memcpy(mat->csr.vals, p, hdr.nnz * esize);
+    p += hdr.nnz * esize;
+    mat->csr.nnz = hdr.nnz;
+  } else {
+    if ((size_t) hdr.rows * hdr.cols > left / esize)
+      return NULL;
+    size_t bytes = (size_t) hdr.rows * hdr.cols * esize;
+    mat = AllocMatrixOfType(hdr.rows, hdr.cols, hdr.type);
+    memcpy(mat->rowp[0], p, bytes);
+    p += bytes;
+  }
+  *src = p;
+  return mat;
+}
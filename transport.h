@@ -0,0 +1,109 @@
+/*
+ *  transport header
+ *  Function prototypes, data, and constants for the socket transport module
+ *
+ *  University of Washington, Tacoma
+ *  TCSS 422 - Operating Systems
+ *  Spring 2019
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "matrix.h"
+
+// Environment variables for remote consumers
+//   PCMATRIX_TRANSPORT        - unix:/path/to/socket or tcp:host:port.
+//                               pcMatrix listens there and pcConsumer
+//                               connects to it.
+//   PCMATRIX_REMOTE_CONSUMERS - number of pcConsumer processes pcMatrix
+//                               waits for, default 1
+#define TRANSPORT_ENV "PCMATRIX_TRANSPORT"
+#define REMOTE_CONSUMERS_ENV "PCMATRIX_REMOTE_CONSUMERS"
+
+// Most matrices sent in one BATCH frame
+#define TRANSPORT_BATCH 16
+
+// Largest frame either side accepts.  The length comes from the peer, so
+// it is checked before anything is allocated for it.  BATCH frames are
+// split to stay under it.
+#define TRANSPORT_MAX_FRAME (1L << 30)
+
+// Seconds pcConsumer keeps retrying to connect
+#define TRANSPORT_CONNECT_WAIT 10
+
+// FRAMES
+// Every frame is a frame_hdr_t followed by len bytes of payload.  Fields
+// are in host byte order; the magic number catches a peer that differs.
+//
+//   FRAME_HELLO   pcMatrix -> pcConsumer  uint32 window, int32 cutoff
+//   FRAME_CREDIT  pcConsumer -> pcMatrix  credit_msg_t
+//   FRAME_BATCH   pcMatrix -> pcConsumer  uint32 count, count packed matrices
+//   FRAME_END     pcMatrix -> pcConsumer  no more matrices
+//   FRAME_STATS   pcConsumer -> pcMatrix  remote_stats_t
+//
+// Flow control is by credit.  The consumer grants the window up front and
+// returns one credit per matrix it frees, so no more than window matrices
+// are ever on the wire or held remotely, the way BOUNDED_BUFFER_SIZE caps
+// the local buffer.  CREDIT frames also carry the products computed
+// since the previous one, so pcMatrix's multiply counters, and the
+// telemetry read from them, move during the run instead of only when
+// the final STATS frame arrives.
+#define TRANSPORT_MAGIC 0x50434d58
+
+typedef enum frame_type {
+  FRAME_HELLO = 1,
+  FRAME_CREDIT,
+  FRAME_BATCH,
+  FRAME_END,
+  FRAME_STATS
+} FrameType;
+
+typedef struct frame_hdr {
+  uint32_t magic;
+  uint32_t type;
+  uint64_t len;
+} frame_hdr_t;
+
+typedef struct credit_msg {
+  uint32_t credits;     // matrices the consumer can take
+  uint32_t reserved;
+  int64_t multiplied;   // products computed since the last CREDIT
+  int64_t sumtotal;     // sum of their elements
+} credit_msg_t;
+
+typedef struct remote_stats {
+  int64_t matrices;     // matrices received
+  int64_t multiplied;   // products computed
+  int64_t sumtotal;     // sum of the elements of all products
+} remote_stats_t;
+
+// Growable byte buffer frames are built in and read into
+typedef struct frame_buf {
+  char *data;
+  size_t len;
+  size_t cap;
+} frame_buf_t;
+
+// Sockets
+int transport_listen(const char *address);
+int transport_accept(int listen_fd);
+void transport_unlisten(int listen_fd, const char *address);
+int transport_connect(const char *address);
+int transport_readable(int fd, int timeout_ms);
+
+// Frames; return 0 on success, -1 on a closed or broken connection
+int send_frame(int fd, FrameType type, const void *payload, size_t len);
+int recv_frame(int fd, frame_buf_t *buf, FrameType *type);
+int frame_buf_append(frame_buf_t *buf, const void *data, size_t len);
+void frame_buf_free(frame_buf_t *buf);
+
+// Matrix packing, dense or CSR.  Packing returns -1, leaving buf as it
+// was, if the buffer can't grow.
+int PackMatrix(Matrix *mat, frame_buf_t *buf);
+size_t PackedBytes(Matrix *mat);
+Matrix *UnpackMatrix(const char **src, const char *end);
+
+#endif